@@ -0,0 +1,176 @@
+//////////////////////////////////////////////////////////////////////////////
+//                            **** BENCH ****                               //
+//                Measure Throughput of Very Short Worker Jobs              //
+//                    Copyright (c) 2025 David Bryant.                      //
+//                          All Rights Reserved.                            //
+//         Distributed under the BSD Software License (see LICENSE)         //
+//////////////////////////////////////////////////////////////////////////////
+
+// bench.c
+
+// This program measures how many very short jobs per second the worker thread
+// manager can get through, which is mostly a measure of the overhead of handing
+// jobs to the worker threads (and waking them up, and getting them to agree on
+// what's been done). The jobs do only a tiny bit of work each, and each writes
+// its result into its own structure.
+//
+// Each worker count (from 1 up to the specified maximum, doubling each time) is
+// run with no queue, with a queue, with jobs enqueued in batches, and with the
+// jobs calling workerSync() to complete in order. To see the effect of keeping
+// the manager's hot fields in separate cache lines, build this (and workers.c)
+// a second time with WORKERS_NO_CACHE_ALIGN defined and compare.
+
+#ifdef __GNUC__
+#define __USE_MINGW_ANSI_STDIO 1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "workers.h"
+
+#define BATCH_SIZE 64
+
+// This is the structure for each job (the "work" is a few rounds of xorshift)
+
+typedef struct {
+    uint32_t seed;                      // input: starting value
+    uint32_t result;                    // output: the result of the work
+} short_job;
+
+static int short_job_function (void *context, void *worker);
+static int ordered_job_function (void *context, void *worker);
+static short_job *last_ordered_job;
+
+static double get_seconds (void)
+{
+    struct timespec now;
+
+    timespec_get (&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Run the specified number of jobs through a fresh worker thread manager in the
+// specified mode and return the number of jobs completed per second.
+
+typedef enum { NoQueue, Queue, Batches, Ordered, NumModes } bench_mode;
+
+static const char *mode_names [] = { "no queue", "queue", "batches", "ordered" };
+
+static double run_jobs (int num_workers, bench_mode mode, short_job *jobs, int num_jobs)
+{
+    Workers *workers = mode == NoQueue ? workersInit (num_workers) : workersInitQueue (num_workers, num_workers * 4);
+    WorkerJobSpec specs [BATCH_SIZE];
+    double start = get_seconds ();
+
+    last_ordered_job = NULL;
+
+    if (mode == Batches)
+        for (int job = 0; job < num_jobs; job += BATCH_SIZE) {
+            int count = num_jobs - job < BATCH_SIZE ? num_jobs - job : BATCH_SIZE;
+
+            for (int i = 0; i < count; ++i) {
+                specs [i].worker_function = short_job_function;
+                specs [i].worker_job = jobs + job + i;
+            }
+
+            workersEnqueueJobs (workers, specs, count, WaitForAvailableWorkerThread);
+        }
+    else
+        for (int job = 0; job < num_jobs; ++job)
+            workersEnqueueJob (workers, mode == Ordered ? ordered_job_function : short_job_function,
+                jobs + job, WaitForAvailableWorkerThread);
+
+    workersWaitAllJobs (workers);
+
+    double elapsed = get_seconds () - start;
+
+    workersDeinit (workers);
+    return num_jobs / elapsed;
+}
+
+// This is the main function. It accepts an optional job count and an optional
+// maximum worker thread count on the command-line and prints a table of the
+// job rates (in thousands of jobs per second) for each worker count and mode.
+
+int main (int argc, char **argv)
+{
+    int num_jobs = 1000000, max_workers = 4;
+
+    if (argc > 1)
+        num_jobs = (int) strtod (argv [1], NULL);
+
+    if (argc > 2)
+        max_workers = atoi (argv [2]);
+
+    if (argc > 3 || num_jobs < 1 || max_workers < 1 || max_workers > 100) {
+        printf ("\nusage: bench [jobs [max workers (1-100)]]\n\n");
+        return 1;
+    }
+
+    short_job *jobs = calloc (num_jobs, sizeof (short_job));
+
+    for (int job = 0; job < num_jobs; ++job)
+        jobs [job].seed = job * 2654435761U + 1;
+
+    printf ("running %d jobs per test (rates are in thousands of jobs per second)\n\n", num_jobs);
+    printf ("workers");
+
+    for (int mode = 0; mode < NumModes; ++mode)
+        printf ("%12s", mode_names [mode]);
+
+    printf ("\n");
+
+    for (int num_workers = 1; num_workers <= max_workers; num_workers = num_workers * 2 > max_workers &&
+        num_workers < max_workers ? max_workers : num_workers * 2) {
+            printf ("%7d", num_workers);
+            fflush (stdout);
+
+            for (int mode = 0; mode < NumModes; ++mode) {
+                printf ("%12.1f", run_jobs (num_workers, mode, jobs, num_jobs) / 1000.0);
+                fflush (stdout);
+            }
+
+            printf ("\n");
+    }
+
+    free (jobs);
+    return 0;
+}
+
+// These are the job functions, which do just a few rounds of xorshift. The second
+// one also calls workerSync() and then checks that the jobs are completing in order.
+
+static int short_job_function (void *context, void *worker)
+{
+    short_job *cxt = context;
+    uint32_t value = cxt->seed;
+
+    (void) worker;
+
+    for (int i = 0; i < 16; ++i) {
+        value ^= value << 13;
+        value ^= value >> 17;
+        value ^= value << 5;
+    }
+
+    cxt->result = value;
+    return 0;
+}
+
+static int ordered_job_function (void *context, void *worker)
+{
+    short_job *cxt = context;
+
+    short_job_function (context, worker);
+    workerSync (worker);
+
+    if (last_ordered_job && cxt != last_ordered_job + 1)
+        fprintf (stderr, "job completed out of order!\n");
+
+    last_ordered_job = cxt;
+    return 0;
+}
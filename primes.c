@@ -37,16 +37,26 @@
 // This is the structure that is used to interface to the slice calculator. The
 // worker manager requires everything that needs to be passed in or out of the
 // worker thread be stored in a single structure (although of course pointers
-// to external data are allowed, with the user ensuring thread safety).
+// to external data are allowed, with the user ensuring thread safety). This one
+// is small enough to be copied into the job queue with the job, so the output
+// has to be a pointer (the worker thread gets its own copy of the structure).
 
 typedef struct {
     const unsigned char *base_primes;   // input: source primes table
     uint64_t slice_start;               // input: start value of slice (multiple of 16)
     int slice_values;                   // input: number of values to consider
-    uint64_t *total_primes;             // output: pointer to total primes counter
-    uint64_t *last_prime;               // output: pointer to last prime storage
+    WorkerReducer *totals;              // output: reduction of the slice totals (see below)
 } prime_slice_interface;
 
+// These are the totals for each slice, which are combined by the worker manager's
+// reduction facility (the counts are added, and the last prime is the highest).
+
+typedef struct {
+    uint64_t total_primes;
+    uint64_t last_prime;
+} prime_totals;
+
+static void combine_totals (void *accumulator, const void *value);
 static int prime_slice (void *context, void *worker);
 
 // This is the main function. It accepts a max prime value and an optional worker
@@ -114,7 +124,7 @@ int main (int argc, char **argv)
             for (int cprime = tprime * tprime; cprime < max_base_prime; cprime += tprime * 2)
                 primes [cprime >> 4] |= 1 << ((cprime >> 1) & 0x7);
 
-    uint64_t prime_count = 1, last_prime;           // 1 prime already accounted for (2)
+    uint64_t prime_count = 1, last_prime = 2;       // 1 prime already accounted for (2)
 
     for (int tprime = 3; tprime < max_base_prime && tprime < max_prime; tprime += 2)
         if (!(primes [tprime >> 4] & ((tprime & 1) << ((tprime >> 1) & 0x7)))) {
@@ -143,30 +153,33 @@ int main (int argc, char **argv)
     // the same size as the "base" data, except for possibly the last one,
 
     if (num_slices) {
-        Workers *workers = workersInit (num_workers);
+        Workers *workers = workersInitQueue (num_workers, num_workers * 2);
+        prime_totals totals = { 0, 0 };
         int progress_percent = -1;
+        WorkerReducer reducer;
+
+        workersReducerInit (&reducer, workers, &totals, sizeof (totals), combine_totals, 0);
 
         printf ("processing %d slices using %d threads...\n", num_slices, num_workers);
 
         for (int slice = 1; slice <= num_slices; ++slice) {
-            prime_slice_interface *interface = malloc (sizeof (prime_slice_interface));
+            prime_slice_interface interface;
 
-            interface->base_primes = primes;
-            interface->slice_start = (uint64_t) max_base_prime * slice;
-            interface->total_primes = &prime_count;
-            interface->last_prime = &last_prime;
+            interface.base_primes = primes;
+            interface.slice_start = (uint64_t) max_base_prime * slice;
+            interface.totals = &reducer;
 
             // For the last slice we calculate a possibly truncated size because this is where the
             // "leftover" values are. Also, we can do this on the main thread because we have to
             // wait for everything else to complete anyway afterward.
 
             if (slice == num_slices) {
-                interface->slice_values = max_prime - interface->slice_start;
-                workersEnqueueJob (workers, prime_slice, interface, DontUseWorkerThread);
+                interface.slice_values = max_prime - interface.slice_start;
+                workersEnqueueJobCopy (workers, prime_slice, &interface, sizeof (interface), DontUseWorkerThread);
             }
             else {
-                interface->slice_values = max_base_prime;
-                workersEnqueueJob (workers, prime_slice, interface, WaitForAvailableWorkerThread);
+                interface.slice_values = max_base_prime;
+                workersEnqueueJobCopy (workers, prime_slice, &interface, sizeof (interface), WaitForAvailableWorkerThread);
             }
 
             if (num_slices > 1000) {
@@ -179,9 +192,16 @@ int main (int argc, char **argv)
             }
         }
 
-        // wait for all the worker threads run to completion and destroy the worker thread manager
+        // wait for all the worker threads run to completion, fold the slice totals into the base
+        // totals, and destroy the worker thread manager
 
         workersWaitAllJobs (workers);
+        totals.total_primes = prime_count;
+        totals.last_prime = last_prime;
+        workersReducerFold (&reducer, &totals);
+        prime_count = totals.total_primes;
+        last_prime = totals.last_prime;
+        workersReducerFree (&reducer);
         workersDeinit (workers);
 
         // report the results
@@ -200,8 +220,8 @@ int main (int argc, char **argv)
 }
 
 // This is the function that calculates the primes in a strip of values, counts
-// them and updates a global count. It also updates a variable holding the highest
-// prime calculated. Of course, this requires a pre-built table containing the
+// them and adds them to the reduction of the totals, along with the highest prime
+// calculated. Of course, this requires a pre-built table containing the
 // primes up to the square root of the highest prime requested. This function is
 // written to use just 32-bit math as much possible for performance, but otherwise
 // should be able to handle primes up to 2^60, which would require the supplied
@@ -215,8 +235,8 @@ static int prime_slice (void *context, void *worker)
     prime_slice_interface *cxt = context;
     int prime_count = cxt->slice_values, slice_count = prime_count + (-prime_count & 0xf);
     int tprime_limit = (int) ceil (sqrt (cxt->slice_start + slice_count));
-    unsigned char *slice_primes = calloc (1, slice_count / 16);
-    uint64_t num_primes = 0, last_prime = 0;
+    unsigned char *slice_primes = workerCalloc (worker, 1, slice_count / 16);
+    prime_totals totals = { 0, 0 };
 
     for (int tprime = 3; tprime < tprime_limit; tprime += 2)
         if (!(cxt->base_primes [tprime >> 4] & (1 << ((tprime >> 1) & 0x7))))
@@ -225,36 +245,35 @@ static int prime_slice (void *context, void *worker)
 
     for (int tprime = 1; tprime < prime_count; tprime += 2)
         if (!(slice_primes [tprime >> 4] & (1 << ((tprime >> 1) & 0x7)))) {
-            last_prime = cxt->slice_start + tprime;
-            num_primes++;
+            totals.last_prime = cxt->slice_start + tprime;
+            totals.total_primes++;
         }
 
-    // The sync here is REQUIRED for correct operation. Without it the "last prime" calculated is often wrong,
-    // which makes sense. However, less obvious is that the "total primes" is also often wrong because it's
-    // no longer modified atomically. This is known edge case that we don't often see consistently show up in
-    // real life, but do primes to a tillion and it will happen many times every run (and always differently).
-    // Another way to fix this problem here is to replace the addition and prime store with code utilizing gcc
-    // builtins to do the operations atomically, and in most cases that will be faster (but is not always as
-    // straightforward as this case).
-
-#if 1
-    workerSync (worker);
-    *cxt->total_primes += num_primes;
-    *cxt->last_prime = last_prime;
-#else
-    __atomic_add_fetch (cxt->total_primes, num_primes, __ATOMIC_RELAXED);
+    // The totals can't simply be added to global totals here, because the slices are running at the same
+    // time and the updates would collide (so the count would often be wrong, and the last prime would be
+    // whichever slice finished last). Calling workerSync() first would fix that, as would updating them
+    // with atomic operations, but both have every slice contending for the same thing. Instead each worker
+    // thread combines the totals of its slices into its own accumulator, and those are folded together
+    // once at the end, so the slices never touch each other's data at all.
 
-    uint64_t old_last;
-    do
-        old_last = __atomic_load_n (cxt->last_prime, __ATOMIC_RELAXED);
-    while (last_prime > old_last && !__atomic_compare_exchange_n (cxt->last_prime, &old_last, last_prime, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
-#endif
+    workerReduce (cxt->totals, worker, &totals);
 
-    // free our primes slice storage (because we allocated it) and also free the job context (which we did
-    // not allocate, but this is a good place to do it so that the caller does not have to deal with that).
+    // Nothing needs to be freed here. The job context is a copy that belongs to the worker manager, and our
+    // primes slice storage is scratch memory from the worker thread, so that's taken back automatically (and
+    // reused for the next slice) when we return.
 
-    free (slice_primes);
-    free (cxt);
     return 0;
 }
 
+// Combine the totals of a slice into an accumulator (in any order, so no numbered parts are needed).
+
+static void combine_totals (void *accumulator, const void *value)
+{
+    prime_totals *totals = accumulator;
+    const prime_totals *slice = value;
+
+    totals->total_primes += slice->total_primes;
+
+    if (slice->last_prime > totals->last_prime)
+        totals->last_prime = slice->last_prime;
+}
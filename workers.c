@@ -18,9 +18,32 @@
 // large mathematical calculations, simulations, or audio-video processing). It
 // is NOT intended for splitting various unrelated or dissimilar tasks into
 // various threads, but it MAY be suitable for that. I simply haven't thought
-// too much about that application. 
+// too much about that application.
+//
+// Jobs are passed to the worker threads through a lock-free multi-producer /
+// multi-consumer ring where each slot carries a sequence number indicating the
+// ring position it's ready to be written (or read) at. Enqueuing a job, picking
+// up a job and all the state queries are done with atomic operations only, and
+// the global mutex is taken only by threads that are going to sleep until
+// something specific happens (and by the threads that have to wake them up).
+// With NUMA awareness there is one of these rings for each NUMA node.
+// Idle worker threads are parked without the mutex at all on Linux, where all
+// the sleeping is done on futexes.
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                 // for pthread_setaffinity_np() and the CPU_SET() macros
+#endif
 
+#include <string.h>
 #include <stdio.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#endif
 
 #include "workers.h"
 
@@ -28,419 +51,3814 @@
 static unsigned int failures, enqueues, currents, last_job, unordered;  // debug info
 #endif
 
-// Each worker thread lives forever inside this function / loop. Both Windows API and
-// pthreads API versions are provided. This is where the user-provided function that
-// actually performs the work is called from.
+#define WORKERS_DEQUE_SIZE 1024     // jobs per worker deque in work-stealing mode (must be a power of 2)
+#define WORKERS_JOB_TABLE_SIZE 65536 // entries in the job table, which is also the most jobs that can be in progress
+                                    // at once (must be a power of 2, and batches of jobs larger than half this are split)
+#define WORKERS_JOB_NUMBER_SPAN 0x40000000 // most job numbers that can be given out past the oldest one not done yet
+#define WORKERS_JOB_UNORDERED 0x100 // flag in a job table entry for a job that doesn't hold up the commit ticket
+#define WORKERS_JOB_COMMIT 0x200    // flag in a job table entry for a job that's done except for its commit function
+#define WORKERS_ARENA_ALIGN 16     // alignment of the scratch memory handed out by workerAlloc() (power of 2)
+#define WORKERS_MAX_HELP_DEPTH 16   // deepest that a thread will run jobs while waiting inside other jobs (see help_until())
+#define WORKERS_MAX_SPIN 50000      // longest we'll spin before sleeping, in nanoseconds (roughly what a sleep
+                                    // and wakeup costs, so if the wait is likely to be longer then don't spin)
+
+static wkr_thread_local WorkerInfo *current_worker;     // the worker that the current thread is (if any)
+static wkr_thread_local WorkerArena caller_arena;       // scratch memory for jobs run on other threads
+static wkr_thread_local WorkerGroup *current_group;     // the group of the job running on the thread (if any)
+static wkr_thread_local Workers *helping;   // the context of the innermost job being run while waiting (if any)
+static wkr_thread_local WorkerInfo *helping_worker;     // the worker context of that job (see run_queued_job())
+
+static uint64_t get_time (void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency (&frequency);
+
+    QueryPerformanceCounter (&counter);
+
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000 +
+        (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Allocate memory (zeroed or not) aligned to a cache line, and free it. This is used for all the
+// structures that have fields aligned to cache lines (see workers.h), for the arrays that are
+// hammered by several threads at once, and for the scratch memory handed out to jobs.
+
+static void *aligned_malloc (size_t size)
+{
+    void *ptr;
 
 #ifdef _WIN32
-static unsigned WINAPI worker_thread (LPVOID param)
+    ptr = _aligned_malloc (size, WORKERS_CACHE_LINE);
 #else
-static void *worker_thread (void *param)
+    if (posix_memalign (&ptr, WORKERS_CACHE_LINE, size))
+        ptr = NULL;
 #endif
+
+    return ptr;
+}
+
+static void *aligned_calloc (size_t num, size_t size)
 {
-    WorkerInfo *thread = param;
-    Workers *global = thread->workers;
+    void *ptr = aligned_malloc (num * size);
+
+    if (ptr)
+        memset (ptr, 0, num * size);
+
+    return ptr;
+}
+
+static void aligned_free (void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free (ptr);
+#else
+    free (ptr);
+#endif
+}
+
+static int get_num_processors (void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo (&info);
+    return (int) info.dwNumberOfProcessors;
+#else
+    return (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+// These are the processors that the worker threads can be pinned to, along with where each one is
+// in the machine's topology (so that the compact and scatter placements can be worked out).
+
+typedef struct {
+    int cpu;                    // processor number (as used by the OS affinity functions)
+    int package, core;          // identifiers of the package (socket) and the core that the processor is on
+    int core_index;             // position of the core within its package (starting with 0)
+    int thread_index;           // position of the processor within its core (starting with 0)
+} WorkerProcessor;
+
+#ifdef __linux__
+static void read_topology_id (int cpu, const char *name, int *id)
+{
+    char path [96];
+    FILE *file;
+
+    snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+    if ((file = fopen (path, "r"))) {
+        if (fscanf (file, "%d", id) != 1)
+            *id = cpu;
+
+        fclose (file);
+    }
+}
+#endif
+
+// Get the processors that we're allowed to run on (the affinity mask, not all the ones in the machine,
+// and on Linux it's the calling thread's, which is what the worker threads would inherit, rather than
+// the main thread's) with their package and core identifiers filled in. If the topology is not available
+// then each processor is treated as its own core. Returns the number of processors (and the array,
+// to be freed by the caller) or zero if the affinity can't be determined (or pinning is not supported).
+
+static int get_processors (WorkerProcessor **processors)
+{
+    int count = 0, i;
+
+#if defined(_WIN32)
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info;
+    DWORD_PTR process_mask, system_mask;
+    DWORD length = 0, j;
+
+    if (!GetProcessAffinityMask (GetCurrentProcess (), &process_mask, &system_mask))
+        return 0;
+
+    *processors = calloc (sizeof (DWORD_PTR) * 8, sizeof (WorkerProcessor));
+
+    for (i = 0; i < (int) sizeof (DWORD_PTR) * 8; ++i)
+        if (process_mask & ((DWORD_PTR) 1 << i)) {
+            (*processors) [count].cpu = (*processors) [count].core = i;
+            count++;
+        }
+
+    // cores are identified by their lowest processor number, and packages by their position in the list
+
+    GetLogicalProcessorInformation (NULL, &length);
+
+    if ((info = malloc (length)) && GetLogicalProcessorInformation (info, &length))
+        for (j = 0; j < length / sizeof (*info); ++j)
+            for (i = 0; i < count; ++i)
+                if (info [j].ProcessorMask & ((DWORD_PTR) 1 << (*processors) [i].cpu)) {
+                    if (info [j].Relationship == RelationProcessorCore)
+                        for ((*processors) [i].core = 0; !(info [j].ProcessorMask & ((DWORD_PTR) 1 << (*processors) [i].core));)
+                            (*processors) [i].core++;
+                    else if (info [j].Relationship == RelationProcessorPackage)
+                        (*processors) [i].package = (int) j;
+                }
+
+    free (info);
+#elif defined(__linux__)
+    cpu_set_t set;
+
+    if (sched_getaffinity (0, sizeof (set), &set))
+        return 0;
+
+    *processors = calloc (CPU_COUNT (&set), sizeof (WorkerProcessor));
+
+    for (i = 0; i < CPU_SETSIZE && count < CPU_COUNT (&set); ++i)
+        if (CPU_ISSET (i, &set)) {
+            (*processors) [count].cpu = (*processors) [count].core = i;
+            read_topology_id (i, "physical_package_id", &(*processors) [count].package);
+            read_topology_id (i, "core_id", &(*processors) [count].core);
+            count++;
+        }
+#else
+    (void) processors;
+    (void) i;
+#endif
+
+    return count;
+}
+
+// These are the orderings of the processors for the compact and scatter placements. The compact one
+// has the processors of each core together (and the cores of each package together), and the scatter
+// one has the first processor of every core before the second processor of any core, with the cores
+// of the packages interleaved.
+
+static int compare_compact (const void *a, const void *b)
+{
+    const WorkerProcessor *pa = a, *pb = b;
+
+    if (pa->package != pb->package)
+        return pa->package < pb->package ? -1 : 1;
+
+    if (pa->core != pb->core)
+        return pa->core < pb->core ? -1 : 1;
+
+    return pa->cpu < pb->cpu ? -1 : pa->cpu > pb->cpu;
+}
+
+static int compare_scatter (const void *a, const void *b)
+{
+    const WorkerProcessor *pa = a, *pb = b;
+
+    if (pa->thread_index != pb->thread_index)
+        return pa->thread_index < pb->thread_index ? -1 : 1;
+
+    if (pa->core_index != pb->core_index)
+        return pa->core_index < pb->core_index ? -1 : 1;
+
+    if (pa->package != pb->package)
+        return pa->package < pb->package ? -1 : 1;
+
+    return pa->cpu < pb->cpu ? -1 : pa->cpu > pb->cpu;
+}
+
+// Choose the processor for each worker thread according to the affinity policy in the configuration.
+// If there are more worker threads than processors then the placement wraps around. Workers that are
+// not getting their own processor (including all of them for NoAffinity and InheritAffinity) get -1.
+
+static void choose_placement (Workers *cxt, const WorkersConfig *config)
+{
+    WorkerProcessor *processors = NULL;
+    int count, i;
+
+    for (i = 0; i < cxt->num_workers; ++i)
+        cxt->workers [i].cpu = -1;
+
+    if (config->affinity == ListAffinity && config->cpu_list && config->cpu_list_size > 0)
+        for (i = 0; i < cxt->num_workers; ++i)
+            cxt->workers [i].cpu = config->cpu_list [i % config->cpu_list_size];
+    else if ((config->affinity == CompactAffinity || config->affinity == ScatterAffinity) &&
+        (count = get_processors (&processors)) > 0) {
+            qsort (processors, count, sizeof (WorkerProcessor), compare_compact);
+
+            // now that the processors of each core (and the cores of each package) are together, number them
+
+            for (i = 1; i < count; ++i)
+                if (processors [i].package != processors [i - 1].package)
+                    continue;
+                else if (processors [i].core != processors [i - 1].core)
+                    processors [i].core_index = processors [i - 1].core_index + 1;
+                else {
+                    processors [i].core_index = processors [i - 1].core_index;
+                    processors [i].thread_index = processors [i - 1].thread_index + 1;
+                }
+
+            if (config->affinity == ScatterAffinity)
+                qsort (processors, count, sizeof (WorkerProcessor), compare_scatter);
+
+            for (i = 0; i < cxt->num_workers; ++i)
+                cxt->workers [i].cpu = processors [i % count].cpu;
+    }
+
+    free (processors);
+}
+
+// Pin the calling thread to the specified processors (usually just one), or if there are none then
+// allow it to run on all the processors that the process is allowed to run on. Returns FALSE if this
+// fails (or if thread affinity is not supported here).
+
+static int pin_current_thread (const int *cpus, int count)
+{
+#if defined(_WIN32)
+    DWORD_PTR process_mask, system_mask, mask = 0;
+    int i;
+
+    if (!count)
+        return GetProcessAffinityMask (GetCurrentProcess (), &process_mask, &system_mask) &&
+            SetThreadAffinityMask (GetCurrentThread (), process_mask) != 0;
+
+    for (i = 0; i < count; ++i)
+        if (cpus [i] >= 0 && cpus [i] < (int) sizeof (DWORD_PTR) * 8)
+            mask |= (DWORD_PTR) 1 << cpus [i];
+
+    return mask && SetThreadAffinityMask (GetCurrentThread (), mask) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO (&set);
+
+    if (!count && sched_getaffinity (getpid (), sizeof (set), &set))
+        return 0;
+
+    for (i = 0; i < count; ++i)
+        if (cpus [i] >= 0 && cpus [i] < CPU_SETSIZE)
+            CPU_SET (cpus [i], &set);
+
+    return CPU_COUNT (&set) && !pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+#else
+    (void) cpus;
+    (void) count;
+    return 0;
+#endif
+}
+
+// Return the processor that the calling thread is running on (or -1 if we can't tell).
+
+static int current_cpu (void)
+{
+#if defined(_WIN32)
+    return (int) GetCurrentProcessorNumber ();
+#elif defined(__linux__)
+    return sched_getcpu ();
+#else
+    return -1;
+#endif
+}
+
+// Return the index of the node that the specified processor is on, or -1 if we don't know.
+
+static int cpu_node (Workers *cxt, int cpu)
+{
+    return cpu >= 0 && cpu < cxt->num_cpu_nodes ? cxt->cpu_nodes [cpu] : -1;
+}
+
+#ifdef __linux__
+static int compare_ints (const void *a, const void *b)
+{
+    return * (const int *) a < * (const int *) b ? -1 : * (const int *) a > * (const int *) b;
+}
+#endif
+
+// Get the NUMA nodes that have processors that the process is allowed to run on, each with the list of
+// those processors (in ascending order) and its operating system node number (the nodes are also in
+// ascending order). Returns the number of nodes (and the array, to be freed by the caller along with
+// each node's list) or zero if the topology is not available (or NUMA is not supported here).
+
+static int get_numa_nodes (WorkerNode **nodes)
+{
+    int count = 0, i;
+
+#if defined(_WIN32)
+    DWORD_PTR process_mask, system_mask;
+    ULONGLONG node_mask;
+    ULONG highest;
+
+    if (!GetProcessAffinityMask (GetCurrentProcess (), &process_mask, &system_mask) || !GetNumaHighestNodeNumber (&highest))
+        return 0;
+
+    *nodes = aligned_calloc (highest + 1, sizeof (WorkerNode));
+
+    for (i = 0; i <= (int) highest; ++i)
+        if (GetNumaNodeProcessorMask ((UCHAR) i, &node_mask) && (node_mask &= process_mask)) {
+            WorkerNode *node = *nodes + count++;
+            int cpu;
+
+            node->node_id = i;
+            node->cpus = malloc (sizeof (DWORD_PTR) * 8 * sizeof (int));
+
+            for (cpu = 0; cpu < (int) sizeof (DWORD_PTR) * 8; ++cpu)
+                if (node_mask & ((ULONGLONG) 1 << cpu))
+                    node->cpus [node->num_cpus++] = cpu;
+        }
+#elif defined(__linux__)
+    int node_ids [256], num_node_ids = 0;
+    struct dirent *entry;
+    cpu_set_t set;
+    DIR *dir;
+
+    if (sched_getaffinity (getpid (), sizeof (set), &set) || !(dir = opendir ("/sys/devices/system/node")))
+        return 0;
+
+    while ((entry = readdir (dir)) && num_node_ids < 256)
+        if (!strncmp (entry->d_name, "node", 4) && entry->d_name [4] >= '0' && entry->d_name [4] <= '9')
+            node_ids [num_node_ids++] = atoi (entry->d_name + 4);
+
+    closedir (dir);
+    qsort (node_ids, num_node_ids, sizeof (int), compare_ints);
+    *nodes = aligned_calloc (num_node_ids ? num_node_ids : 1, sizeof (WorkerNode));
+
+    // each node's processors are in a list of ranges like "0-7,16-23"
+
+    for (i = 0; i < num_node_ids; ++i) {
+        WorkerNode *node = *nodes + count;
+        int first, last, cpu;
+        char path [64];
+        FILE *file;
+
+        snprintf (path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", node_ids [i]);
+
+        if (!(file = fopen (path, "r")))
+            continue;
+
+        node->node_id = node_ids [i];
+        node->cpus = malloc (CPU_COUNT (&set) * sizeof (int));
+
+        while (fscanf (file, "%d", &first) == 1) {
+            if (fscanf (file, "-%d", &last) != 1)
+                last = first;
+
+            for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET (cpu, &set) && node->num_cpus < CPU_COUNT (&set))
+                    node->cpus [node->num_cpus++] = cpu;
+
+            if (fgetc (file) != ',')
+                break;
+        }
+
+        fclose (file);
+
+        if (node->num_cpus)
+            count++;
+        else {
+            free (node->cpus);
+            node->cpus = NULL;
+        }
+    }
+#else
+    (void) nodes;
+    (void) i;
+#endif
+
+    return count;
+}
+
+// Divide the worker threads among the NUMA nodes (if NUMA awareness was requested and there's more than
+// one node that we can run on), otherwise put them all in a single node. Worker threads that are pinned to
+// a processor go on that processor's node, and the others are spread over the nodes in proportion to the
+// number of processors on each (and are later pinned to all the processors on their node). The rings are
+// allocated here too, each big enough for all the jobs that can be pending (because they might all be
+// meant for the same node).
+
+static void assign_nodes (Workers *cxt, const WorkersConfig *config)
+{
+    uint32_t ring_size = 1, i;
+    int total_cpus = 0, n;
+
+    if (!config->numa_aware || (cxt->num_nodes = get_numa_nodes (&cxt->nodes)) < 2) {
+        if (cxt->nodes)
+            for (n = 0; n < cxt->num_nodes; ++n)
+                free (cxt->nodes [n].cpus);
+
+        aligned_free (cxt->nodes);
+        cxt->nodes = aligned_calloc (cxt->num_nodes = 1, sizeof (WorkerNode));
+        cxt->nodes [0].node_id = -1;
+    }
+    else {
+        for (n = 0; n < cxt->num_nodes; ++n)
+            for (i = 0; i < (uint32_t) cxt->nodes [n].num_cpus; ++i)
+                if (cxt->nodes [n].cpus [i] >= cxt->num_cpu_nodes)
+                    cxt->num_cpu_nodes = cxt->nodes [n].cpus [i] + 1;
+
+        cxt->cpu_nodes = malloc (cxt->num_cpu_nodes * sizeof (int));
+
+        for (i = 0; i < (uint32_t) cxt->num_cpu_nodes; ++i)
+            cxt->cpu_nodes [i] = -1;
+
+        for (n = 0; n < cxt->num_nodes; ++n) {
+            for (i = 0; i < (uint32_t) cxt->nodes [n].num_cpus; ++i)
+                cxt->cpu_nodes [cxt->nodes [n].cpus [i]] = n;
+
+            total_cpus += cxt->nodes [n].num_cpus;
+        }
+    }
+
+    for (i = 0; i < (uint32_t) cxt->num_workers; ++i) {
+        int position = (int) ((int64_t) i * total_cpus / cxt->num_workers);
+
+        if ((n = cpu_node (cxt, cxt->workers [i].cpu)) < 0)
+            for (n = 0; n < cxt->num_nodes - 1 && position >= cxt->nodes [n].num_cpus; ++n)
+                position -= cxt->nodes [n].num_cpus;
+
+        cxt->workers [i].node = cxt->nodes + n;
+        cxt->nodes [n].num_workers++;
+    }
+
+    while (ring_size < (uint32_t) (cxt->num_workers + cxt->queue_depth))
+        ring_size <<= 1;
+
+    for (n = 0; n < cxt->num_nodes; ++n) {
+        cxt->nodes [n].queue = aligned_calloc (ring_size, sizeof (WorkerJob));
+        cxt->nodes [n].queue_mask = ring_size - 1;
+
+        for (i = 0; i < ring_size; ++i)
+            cxt->nodes [n].queue [i].sequence = i;
+    }
+}
+
+static void free_nodes (Workers *cxt)
+{
+    int n;
+
+    for (n = 0; n < cxt->num_nodes; ++n) {
+        aligned_free (cxt->nodes [n].queue);
+        free (cxt->nodes [n].cpus);
+    }
+
+    aligned_free (cxt->nodes);
+    cxt->nodes = NULL;
+    free (cxt->cpu_nodes);
+    cxt->cpu_nodes = NULL;
+}
+
+// Update the running average of how long waits of the specified kind take. Several threads might
+// be doing this at once, but it's just an estimate so it doesn't matter if an update gets lost.
+
+static void update_wait_stats (WorkerWaitStats *stats, uint64_t wait_time, int parked)
+{
+    uint32_t average = wkr_atomic_load (stats->wait_time);
+
+    if (wait_time > 1000000000)
+        wait_time = 1000000000;
+
+    wkr_atomic_store (stats->wait_time, average + ((int32_t) wait_time - (int32_t) average) / 8);
+
+    if (parked)
+        wkr_atomic_add64 (stats->parks, 1);
+    else
+        wkr_atomic_add64 (stats->spins, 1);
+}
+
+// Spin until the specified condition function returns TRUE, for up to twice the average recent wait
+// time of this kind, first with the processor's "pause" instruction and then yielding the processor.
+// If the average wait is longer than a sleep and wakeup cost anyway (or there's only one processor,
+// in which case whatever we're waiting for can't happen while we spin), then we don't spin at all.
+// Returns TRUE if the condition was met, otherwise the caller should go to sleep. Either way the
+// start time of the wait is returned so that the caller can update the statistics.
+
+static int spin_until (Workers *cxt, WorkerWaitStats *stats, int (*condition)(Workers *, void *), void *param, uint64_t *start)
+{
+    uint64_t elapsed, spin_time = (uint64_t) wkr_atomic_load (stats->wait_time) * 2;
+    int i;
+
+    *start = get_time ();
+
+    if (spin_time > cxt->max_spin)
+        spin_time = 0;
+
+    while ((elapsed = get_time () - *start) < spin_time) {
+        if (elapsed < spin_time / 2)
+            for (i = 0; i < 16; ++i)
+                wkr_cpu_relax ();
+        else
+            wkr_thread_yield ();
+
+        if (condition (cxt, param)) {
+            update_wait_stats (stats, get_time () - *start, 0);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// These functions implement the wait records that threads use to sleep until something specific
+// happens (for example, a certain job completing, or a worker thread becoming available). The
+// waiting thread adds its record to the list and then checks its condition, and the thread that
+// makes something happen changes the condition and then checks for waiters, so a wakeup can never
+// be lost. And if nobody is waiting then wake_waiters() is just a single atomic read.
+//
+// Take a waiter's record back out of the list, unless somebody has already woken it (in which case
+// they took it out).
+
+static void remove_waiter (Workers *cxt, WorkerWaiter *waiter)
+{
+    WorkerWaiter **link;
+
+    wkr_mutex_obtain (cxt->mutex);
+
+    if (!waiter->woken) {
+        for (link = &cxt->waiters; *link != waiter; link = &(*link)->next);
+        *link = waiter->next;
+        wkr_atomic_add (cxt->num_waiters, -1);
+    }
+
+    wkr_mutex_release (cxt->mutex);
+}
+
+// Block until the specified condition function returns TRUE, spinning first (see spin_until()
+// above) and only then going to sleep until woken for the specified address and value. If value
+// is NULL then zero is used, otherwise it's read each time the record is added to the list so that
+// the condition function can change what we're waiting for (which is how workerSync() waits for
+// one earlier job at a time). The time recorded for a wait that went to sleep is up to when it was
+// woken (rather than when it got going again) so that the time taken to wake up doesn't inflate
+// the average and stop us from spinning.
+//
+// The second version gives up at the specified deadline (on the get_time() clock, and can be
+// WORKERS_NO_DEADLINE) and returns whether the condition was met. Waits that time out are not
+// counted in the statistics (because they didn't really end).
+//
+// Threads other than our worker threads run jobs from the queue instead of spinning or sleeping when
+// there are any (see help_until()), but not when there's a deadline (because the job might not be done
+// in time).
+
+#define WORKERS_NO_DEADLINE UINT64_MAX
+
+static int help_until (Workers *cxt, int (*condition)(Workers *, void *), void *param);
+
+static int wait_until_deadline (Workers *cxt, const void *address, const uint32_t *value,
+    int (*condition)(Workers *, void *), void *param, uint64_t deadline)
+{
+    uint64_t start, now = 0, wake_time = 0;
+    WorkerWaiter waiter, **link;
+    int done = 0;
+
+    if (condition (cxt, param))
+        return 1;
+
+    if (deadline != WORKERS_NO_DEADLINE && get_time () >= deadline)
+        return 0;
+
+    if ((deadline == WORKERS_NO_DEADLINE && help_until (cxt, condition, param)) ||
+        spin_until (cxt, &cxt->wait_stats, condition, param, &start))
+            return 1;
+
+    waiter.address = address;
+#ifndef WORKERS_FUTEX
+    wkr_condvar_init (waiter.condvar);
+#endif
+
+    while (1) {
+        waiter.next = NULL;
+        waiter.value = value ? *value : 0;
+        waiter.woken = 0;
+
+        // add our record to the end of the list (so that single wakeups go to the longest waiter)
+
+        wkr_mutex_obtain (cxt->mutex);
+        for (link = &cxt->waiters; *link; link = &(*link)->next);
+        *link = &waiter;
+        wkr_atomic_add (cxt->num_waiters, 1);
+        wkr_mutex_release (cxt->mutex);
+
+        // If the condition is already met (or what we're waiting for changed) then take our record
+        // back out (unless somebody has already woken us).
+
+        if ((done = condition (cxt, param)) || (value && *value != waiter.value)) {
+            remove_waiter (cxt, &waiter);
+
+            if (done)
+                break;
+            else
+                continue;
+        }
+
+        // sleep until we're woken (or the deadline passes, if there is one)
+
+        now = 0;
+
+#ifdef WORKERS_FUTEX
+        while (!wkr_atomic_load (waiter.woken))
+            if (deadline == WORKERS_NO_DEADLINE)
+                wkr_futex_wait (waiter.woken, 0);
+            else if ((now = get_time ()) < deadline)
+                wkr_futex_wait_timeout (waiter.woken, 0, deadline - now);
+            else
+                break;
+#else
+        wkr_mutex_obtain (cxt->mutex);
+
+        while (!waiter.woken)
+            if (deadline == WORKERS_NO_DEADLINE)
+                wkr_condvar_wait (waiter.condvar, cxt->mutex);
+            else if ((now = get_time ()) < deadline)
+                wkr_condvar_wait_timeout (waiter.condvar, cxt->mutex, deadline - now);
+            else
+                break;
+
+        wkr_mutex_release (cxt->mutex);
+#endif
+
+        // if we timed out then it's the condition right now that counts
+
+        if (now >= deadline) {
+            remove_waiter (cxt, &waiter);
+            done = condition (cxt, param);
+            break;
+        }
+
+        wake_time = waiter.wake_time;
+
+        if ((done = condition (cxt, param)) || (deadline == WORKERS_NO_DEADLINE && (done = help_until (cxt, condition, param))))
+            break;
+    }
+
+#ifndef WORKERS_FUTEX
+    wkr_condvar_delete (waiter.condvar);
+#endif
+    if (now < deadline)
+        update_wait_stats (&cxt->wait_stats, (wake_time > start ? wake_time : get_time ()) - start, 1);
+
+    return done;
+}
+
+static void wait_until (Workers *cxt, const void *address, const uint32_t *value,
+    int (*condition)(Workers *, void *), void *param)
+{
+    wait_until_deadline (cxt, address, value, condition, param, WORKERS_NO_DEADLINE);
+}
+
+// Wake up (at most) the specified number of threads waiting for the specified address and value,
+// starting with the one that has been waiting the longest.
+
+static void wake_waiters (Workers *cxt, const void *address, uint32_t value, int count)
+{
+    WorkerWaiter **link, *waiter;
+    uint64_t wake_time;
+
+    if (!wkr_atomic_load (cxt->num_waiters))
+        return;
+
+    wake_time = get_time ();
+    wkr_mutex_obtain (cxt->mutex);
+
+    for (link = &cxt->waiters; (waiter = *link) && count; )
+        if (waiter->address == address && waiter->value == value) {
+            *link = waiter->next;
+            wkr_atomic_add (cxt->num_waiters, -1);
+            waiter->wake_time = wake_time;
+            wkr_atomic_store (waiter->woken, 1);
+#ifdef WORKERS_FUTEX
+            wkr_futex_wake (waiter->woken, 1);
+#else
+            wkr_condvar_signal (waiter->condvar);
+#endif
+            count--;
+        }
+        else
+            link = &waiter->next;
+
+    wkr_mutex_release (cxt->mutex);
+}
+
+// Release the places of the specified number of pending jobs (see reserve_jobs() below), either
+// because they're done or because they weren't enqueued after all. This wakes one thread waiting
+// to enqueue a job for each place released, and the threads waiting for all the jobs to be done
+// if that's now the case.
+
+static void release_jobs (Workers *cxt, int count)
+{
+    if (!wkr_atomic_add (cxt->jobs_pending, -count))
+        wake_waiters (cxt, &cxt->jobs_pending, 0, INT32_MAX);
+
+    wake_waiters (cxt, &cxt->workers_ready, 0, count);
+}
+
+// The job table records the status of every job that could still be of interest, which is every
+// job number from the commit ticket (the oldest job not done yet) to the most recent one given out.
+// Each entry holds a job number and its status in a single 64-bit word, indexed by the job number,
+// so nothing has to be cleared when an entry is reused. An entry is only reused once the job using it
+// is done (see allocate_job_numbers()), so if a job's entry now holds a newer job then it's done, and
+// a job number whose entry is still in use by an older job when it comes up (like the first job of a
+// long divide-and-conquer tree, which is running the whole time) is simply skipped over and recorded
+// in the skip table instead. That way one long job can't hold up the giving out of job numbers (which
+// would be a deadlock if it was waiting for jobs that it's trying to enqueue). Jobs that are run right
+// where they're enqueued are not ordered with the others, so while they run their status is flagged with
+// WORKERS_JOB_UNORDERED, which lets the commit ticket pass them. Jobs with commit functions are flagged
+// with WORKERS_JOB_COMMIT once they've run, until the commit ticket gets to them (see finish_job()).
+
+static void set_job_status (Workers *cxt, uint32_t job_number, WorkerJobStatus status)
+{
+    wkr_atomic_store64 (cxt->job_table [job_number & (WORKERS_JOB_TABLE_SIZE - 1)], (uint64_t) job_number << 32 | status);
+}
+
+static WorkerJobStatus job_status (Workers *cxt, uint32_t job_number)
+{
+    uint64_t entry = wkr_atomic_load64 (cxt->job_table [job_number & (WORKERS_JOB_TABLE_SIZE - 1)]);
+
+    if ((uint32_t) (entry >> 32) == job_number)
+        return (WorkerJobStatus) (entry & 0xff);
+
+    if (A_BEFORE_B (job_number, (uint32_t) (entry >> 32)) ||
+        wkr_atomic_load (cxt->skip_table [job_number & (WORKERS_JOB_TABLE_SIZE - 1)]) == job_number)
+            return JobDone;
+
+    return A_BEFORE_B (job_number, wkr_atomic_load (cxt->commit_ticket)) ? JobDone : JobUnknown;
+}
+
+// The results table is just like the job table, except that it holds the value returned by each job
+// (see workersGetJobResult()). It's separate from the status because the commit ticket can pass a job
+// before its result is in: jobs run on the user's thread are flagged with WORKERS_JOB_UNORDERED while they
+// run, so they're "Running" until their results are set, but by then the ticket might be well past them
+// (and the results entry might have even been reused by a newer job, in which case the result is simply
+// dropped, because a newer result is never overwritten with an older one).
+
+static void set_job_result (Workers *cxt, uint32_t job_number, int result)
+{
+    uint64_t *entry = cxt->job_results + (job_number & (WORKERS_JOB_TABLE_SIZE - 1)), value;
+
+    do
+        value = wkr_atomic_load64 (*entry);
+    while (A_BEFORE_B ((uint32_t) (value >> 32), job_number) &&
+        !wkr_atomic_cas64 (*entry, value, (uint64_t) job_number << 32 | (uint32_t) result));
+}
+
+// The cancel table is also indexed by job number, but an entry just holds the number of the last job
+// using it that was cancelled (see workersCancelJob()), so a job has been cancelled if its entry holds
+// its own number. Like the results, a newer entry is never overwritten with an older one. Returns
+// TRUE if the job was not already cancelled.
+
+static int cancel_job (Workers *cxt, uint32_t job_number)
+{
+    uint32_t *entry = cxt->cancel_table + (job_number & (WORKERS_JOB_TABLE_SIZE - 1)), value;
+
+    do
+        if (!A_BEFORE_B (value = wkr_atomic_load (*entry), job_number))
+            return 0;
+    while (!wkr_atomic_cas (*entry, value, job_number));
+
+    return 1;
+}
+
+static int job_cancelled (Workers *cxt, uint32_t job_number)
+{
+    return wkr_atomic_load (cxt->cancel_table [job_number & (WORKERS_JOB_TABLE_SIZE - 1)]) == job_number;
+}
+
+// Advance the commit ticket past any jobs that are done (or skipped, or whose entries have already been
+// reused, which means they're done) starting with the oldest one not known to be done, but never past
+// the next job number to be given out (which could look done if its entry is stale). Several threads
+// can be advancing the ticket at once, but each advance is a CAS so that's fine, and each wakes only the
+// job that's up next (if it's waiting in workerSync()) along with anything waiting for job numbers.
+// When the ticket gets to a job that's waiting to run its commit function, the thread that takes it
+// (with a CAS on its entry, so only one does) runs it right here and then carries on, and any other
+// thread simply stops there, so nothing ever blocks waiting for a commit.
+
+static void release_held_jobs (Workers *cxt, uint32_t job_number);
+static void run_commit (Workers *cxt, uint32_t job_number);
+
+static void advance_ticket (Workers *cxt)
+{
+    uint32_t ticket, index;
+    uint64_t entry;
+
+    while (1) {
+        ticket = wkr_atomic_load (cxt->commit_ticket);
+        index = ticket & (WORKERS_JOB_TABLE_SIZE - 1);
+        entry = wkr_atomic_load64 (cxt->job_table [index]);
+
+        if (entry == ((uint64_t) ticket << 32 | JobRunning | WORKERS_JOB_COMMIT)) {
+            if (wkr_atomic_cas64 (cxt->job_table [index], entry, (uint64_t) ticket << 32 | JobRunning))
+                run_commit (cxt, ticket);
+
+            continue;
+        }
+
+        if (ticket == wkr_atomic_load (cxt->job_number) ||
+            (entry != ((uint64_t) ticket << 32 | JobDone) && !A_BEFORE_B (ticket, (uint32_t) (entry >> 32)) &&
+            ((uint32_t) (entry >> 32) != ticket || !(entry & WORKERS_JOB_UNORDERED)) &&
+            wkr_atomic_load (cxt->skip_table [index]) != ticket))
+                break;
+
+        if (wkr_atomic_cas (cxt->commit_ticket, ticket, ticket + 1))
+            wake_waiters (cxt, &cxt->commit_ticket, ticket + 1, INT32_MAX);
+    }
+}
+
+// Record that the specified job is done, and advance the commit ticket past it if it's the oldest one
+// not done.
+
+static void commit_job (Workers *cxt, uint32_t job_number)
+{
+    set_job_status (cxt, job_number, JobDone);
+    advance_ticket (cxt);
+}
+
+// Finish up a job that has run (or was dropped because it was cancelled) by recording it as done and
+// waking whatever was waiting for it. A job with a commit function isn't done until that has run too,
+// in job order (see workersEnqueueJobCommit()), so instead it's flagged as waiting for its commit and
+// left for whichever thread advances the commit ticket to it (which is this one if it's already there).
+
+static void finish_job (Workers *cxt, uint32_t job_number, void (*commit)(void*), void *job)
+{
+    if (commit && !job_cancelled (cxt, job_number)) {
+        WorkerCommit *entry = cxt->commit_table + (job_number & (WORKERS_JOB_TABLE_SIZE - 1));
+
+        entry->commit_function = commit;
+        entry->worker_job = job;
+        wkr_atomic_add (cxt->commits_pending, 1);
+        set_job_status (cxt, job_number, (WorkerJobStatus) (JobRunning | WORKERS_JOB_COMMIT));
+        advance_ticket (cxt);
+    }
+    else {
+        commit_job (cxt, job_number);
+        wake_waiters (cxt, &cxt->job_number, job_number, INT32_MAX);
+        release_held_jobs (cxt, job_number);
+    }
+}
+
+// Run the commit function of a job now that the commit ticket has come to it (see advance_ticket()),
+// unless the job was cancelled in the meantime, and then it's done. The commit function runs as if it
+// were a job (so it can enqueue jobs, but never waits for room to do so). Waits for all jobs to be done
+// also wait for the commits, so they're woken when the last one is done.
+
+static void run_commit (Workers *cxt, uint32_t job_number)
+{
+    WorkerCommit *entry = cxt->commit_table + (job_number & (WORKERS_JOB_TABLE_SIZE - 1));
+    Workers *previous = helping;
+
+    if (!job_cancelled (cxt, job_number)) {
+        helping = cxt;
+        entry->commit_function (entry->worker_job);
+        helping = previous;
+    }
+
+    set_job_status (cxt, job_number, JobDone);
+    wake_waiters (cxt, &cxt->job_number, job_number, INT32_MAX);
+    release_held_jobs (cxt, job_number);
+
+    if (!wkr_atomic_add (cxt->commits_pending, -1) && !wkr_atomic_load (cxt->jobs_pending))
+        wake_waiters (cxt, &cxt->jobs_pending, 0, INT32_MAX);
+}
+
+// Take over the job table entry for a job number that's just been given out, and set its status. The
+// entry can always be taken if the job number is within the size of the table past the commit ticket
+// (because then the job that last had it is older than the ticket, and so must be done), but otherwise
+// only if that job (whatever it was) has been recorded as done. This is a CAS because a thread that has
+// been given a newer job number for the same entry could get there first (if we were held up long enough)
+// and in that case the entry is not taken. Returns FALSE if the entry can't be taken.
+
+static int claim_job_entry (Workers *cxt, uint32_t job_number, WorkerJobStatus status, uint32_t ticket)
+{
+    uint64_t *entry = cxt->job_table + (job_number & (WORKERS_JOB_TABLE_SIZE - 1)), value;
+
+    do
+        if (A_BEFORE_B (job_number, (uint32_t) ((value = wkr_atomic_load64 (*entry)) >> 32)) ||
+            (job_number - ticket >= WORKERS_JOB_TABLE_SIZE && (value & 0xffffffff) != JobDone))
+                return 0;
+    while (!wkr_atomic_cas64 (*entry, value, (uint64_t) job_number << 32 | status));
+
+    return 1;
+}
+
+// Pass over a job number that's not going to be used, which means recording it as done or, if its entry
+// in the job table is still in use, in the skip table instead (it still has to be passed by the commit
+// ticket). Like the cancel table, a newer skipped number is never overwritten with an older one.
+
+static void pass_job_number (Workers *cxt, uint32_t job_number, uint32_t ticket)
+{
+    uint32_t *entry = cxt->skip_table + (job_number & (WORKERS_JOB_TABLE_SIZE - 1)), value;
+
+    if (!claim_job_entry (cxt, job_number, JobDone, ticket))
+        do
+            if (!A_BEFORE_B (value = wkr_atomic_load (*entry), job_number))
+                break;
+        while (!wkr_atomic_cas (*entry, value, job_number));
+
+    advance_ticket (cxt);
+}
+
+// This is a batch of jobs being enqueued. The jobs are either specified with an array of WorkerJobSpec
+// structures (each with its own function and job pointer) or all use the same function and have their
+// payloads, which are copied into the jobs, packed in an array (see workersEnqueueJobsCopy()).
+
+typedef struct {
+    const WorkerJobSpec *jobs;  // the jobs (when they don't have payloads)
+    int (*function)(void*,void*); // the function for all the jobs (when they do)
+    const char *payloads;       // the packed array of payloads (or NULL if the jobs don't have them)
+    int payload_size;           // size of each payload
+    void (*commit)(void*);      // the commit function for all the jobs (only for jobs without payloads)
+} WorkerBatch;
+
+// Fill in the worker function and work "data" of a job from the specified job of a batch.
+
+static void fill_job (WorkerJob *job, const WorkerBatch *batch, int index)
+{
+    if (batch->payloads) {
+        job->worker_function = batch->function;
+        job->worker_job = NULL;
+        job->payload_size = batch->payload_size;
+        memcpy (&job->payload, batch->payloads + (size_t) index * batch->payload_size, batch->payload_size);
+    }
+    else {
+        job->worker_function = batch->jobs [index].worker_function;
+        job->worker_job = batch->jobs [index].worker_job;
+        job->payload_size = 0;
+    }
+
+    job->commit_function = batch->commit;
+}
+
+// Put the specified number of jobs (with consecutive job numbers) into the ring. This must only be
+// called after places for the jobs have been reserved (see reserve_jobs() below) which guarantees
+// that the slots we get are free, or at least will be as soon as the worker threads that just took
+// the previous jobs out of them finish reading them. The ring positions for all the jobs are taken
+// with a single atomic operation, so the jobs are consecutive in the ring too, and each job can be
+// picked up by a worker as soon as it's written (even before the rest are written).
+
+static void ring_push (WorkerNode *node, uint32_t job_number, const WorkerBatch *batch, int index, int count)
+{
+    uint32_t pos = wkr_atomic_add (node->enqueue_pos, count) - count;
+    int i;
+
+    for (i = 0; i < count; ++i, ++pos) {
+        WorkerJob *slot = node->queue + (pos & node->queue_mask);
+
+        while (wkr_atomic_load (slot->sequence) != pos)
+            wkr_cpu_relax ();
+
+        wkr_atomic_store (slot->job_number, job_number + i);
+        fill_job (slot, batch, index + i);
+        wkr_atomic_store (slot->sequence, pos + 1);
+    }
+}
+
+// When a worker has claimed a job (from the ring or from a deque) it makes it its current job and marks
+// it "Running" in the job table. If the job has a payload then that's copied out to the worker (because
+// the slot it's in is about to be reused).
+
+static void claim_job (WorkerInfo *thread, const WorkerJob *job)
+{
+    if (job->payload_size) {
+        memcpy (&thread->payload, &job->payload, job->payload_size);
+        thread->worker_job = &thread->payload;
+    }
+    else
+        thread->worker_job = job->worker_job;
+
+    thread->worker_function = job->worker_function;
+    thread->commit_function = job->commit_function;
+    wkr_atomic_store (thread->job_number, job->job_number);
+    wkr_atomic_store (thread->state, Running);
+    set_job_status (thread->workers, job->job_number, JobRunning);
+}
+
+// Take the oldest job from the specified node's ring (if there is one) and make it the specified
+// worker's current job, returning TRUE on success. If a job number is specified then the oldest job
+// is only taken if it comes before that one (see run_queued_job()), so zero means any job.
+
+static int ring_pop (WorkerNode *node, WorkerInfo *thread, uint32_t before)
+{
+    uint32_t pos = wkr_atomic_load (node->dequeue_pos);
+
+    while (1) {
+        WorkerJob *slot = node->queue + (pos & node->queue_mask);
+        int32_t diff = (int32_t) (wkr_atomic_load (slot->sequence) - (pos + 1));
+
+        if (diff < 0)               // the ring is empty (at least at this position)
+            return 0;
+
+        if (diff == 0 && before && !A_BEFORE_B (wkr_atomic_load (slot->job_number), before))
+            return 0;
+
+        if (diff == 0 && wkr_atomic_cas (node->dequeue_pos, pos, pos + 1)) {
+            claim_job (thread, slot);
+            wkr_atomic_store (slot->sequence, pos + node->queue_mask + 1);
+            return 1;
+        }
+
+        pos = wkr_atomic_load (node->dequeue_pos);
+    }
+}
+
+// Push the specified jobs (with consecutive job numbers) onto the bottom of the current worker's own
+// deque (work-stealing mode only), returning FALSE if they don't all fit. Only the owning worker
+// thread can call this.
+
+static int deque_push (WorkerDeque *deque, uint32_t job_number, const WorkerBatch *batch, int count)
+{
+    int32_t bottom = wkr_atomic_load (deque->bottom), top = wkr_atomic_load (deque->top);
+    int i;
+
+    if (bottom - top + count > (int32_t) deque->mask + 1)
+        return 0;
+
+    for (i = 0; i < count; ++i) {
+        WorkerJob *job = deque->jobs + ((bottom + i) & deque->mask);
+
+        job->job_number = job_number + i;
+        fill_job (job, batch, i);
+    }
+
+    wkr_atomic_store (deque->bottom, bottom + count);
+    return 1;
+}
+
+// Pop the most recently pushed job from the bottom of the worker's own deque and make it the worker's
+// current job, returning TRUE on success. Only the owning worker thread can call this, and the only
+// contention is with thieves when there's just one job left (which is resolved on the "top" index).
+
+static int deque_pop (WorkerDeque *deque, WorkerInfo *thread)
+{
+    int32_t bottom = wkr_atomic_load (deque->bottom) - 1, top = wkr_atomic_load (deque->top);
+    WorkerJob *job = deque->jobs + (bottom & deque->mask);
+    int success = 1;
+
+    if (bottom - top < 0)           // quick check for empty deque
+        return 0;
+
+    wkr_atomic_store (deque->bottom, bottom);
+    top = wkr_atomic_load (deque->top);
+
+    if (bottom - top < 0)           // a thief got the last job
+        success = 0;
+    else if (bottom == top)         // this is the last job, so we have to race the thieves for it
+        success = wkr_atomic_cas (deque->top, top, top + 1);
+
+    if (success && bottom != top) {
+        claim_job (thread, job);
+        return 1;
+    }
+
+    wkr_atomic_store (deque->bottom, bottom + 1);
+
+    if (success)
+        claim_job (thread, job);
+
+    return success;
+}
+
+// Steal the oldest job from the top of the specified victim's deque and make it the specified
+// worker's current job, returning TRUE on success. Note that we have to copy the job out of the
+// deque before claiming it because once we've claimed it the owner is free to overwrite it.
+
+static int deque_steal (WorkerDeque *deque, WorkerInfo *thread)
+{
+    int32_t top = wkr_atomic_load (deque->top), bottom = wkr_atomic_load (deque->bottom);
+    WorkerJob job;
+
+    if (bottom - top <= 0)
+        return 0;
+
+    job = deque->jobs [top & deque->mask];
+
+    if (wkr_atomic_cas (deque->top, top, top + 1)) {
+        claim_job (thread, &job);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Try to steal a job from the other workers (either the ones on the same node or the ones on the other
+// nodes), starting with a randomly selected victim.
+
+static int steal_job (Workers *cxt, WorkerInfo *thread, int same_node)
+{
+    int victim, i;
+
+    thread->random ^= thread->random << 13;
+    thread->random ^= thread->random >> 17;
+    thread->random ^= thread->random << 5;
+    victim = thread->random % cxt->num_workers;
+
+    for (i = 0; i < cxt->num_workers; ++i, victim = (victim + 1) % cxt->num_workers)
+        if (victim + 1 != thread->worker_number && (cxt->workers [victim].node == thread->node) == same_node &&
+            deque_steal (&cxt->workers [victim].deque, thread))
+                return 1;
+
+    return 0;
+}
+
+// Return TRUE if there is a job waiting in the node's ring at the current dequeue position.
+
+static int ring_has_job (WorkerNode *node)
+{
+    uint32_t pos = wkr_atomic_load (node->dequeue_pos);
+
+    return wkr_atomic_load (node->queue [pos & node->queue_mask].sequence) == pos + 1;
+}
+
+// Find a job for the specified worker and make it the worker's current job, returning TRUE on success.
+// Jobs meant for the worker's own node come first: those in its own deque (work-stealing mode only), in
+// its node's ring, and in the deques of the other workers on its node. Only when there are none of those
+// do we go to the rings (and deques) of the other nodes. The worker's local and remote job counts are
+// updated here (and only ever written by the worker itself). The deque is passed separately because
+// this is also used to find jobs for threads that are waiting (see run_queued_job()), which might not
+// have one, and which might only be able to take jobs from the rings that come before a certain job.
+
+static int find_job (Workers *cxt, WorkerInfo *thread, WorkerDeque *deque, uint32_t before)
+{
+    int stealing = cxt->scheduling == WorkStealingScheduling, i;
+
+    if ((stealing && deque && deque_pop (deque, thread)) || ring_pop (thread->node, thread, before) || (stealing && steal_job (cxt, thread, 1))) {
+        wkr_atomic_store64 (thread->local_jobs, thread->local_jobs + 1);
+        return 1;
+    }
+
+    for (i = 0; i < cxt->num_nodes; ++i)
+        if (cxt->nodes + i != thread->node && ring_pop (cxt->nodes + i, thread, before)) {
+            wkr_atomic_store64 (thread->remote_jobs, thread->remote_jobs + 1);
+            return 1;
+        }
+
+    if (stealing && cxt->num_nodes > 1 && steal_job (cxt, thread, 0)) {
+        wkr_atomic_store64 (thread->remote_jobs, thread->remote_jobs + 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Idle workers sleep until there's a job in a ring (or in a deque) or they've been told to quit.
+
+static int job_available (Workers *cxt, void *param)
+{
+    int i;
+
+    (void) param;
+
+    if (wkr_atomic_load (cxt->quit))
+        return 1;
+
+    for (i = 0; i < cxt->num_nodes; ++i)
+        if (ring_has_job (cxt->nodes + i))
+            return 1;
+
+    if (cxt->scheduling == WorkStealingScheduling)
+        for (i = 0; i < cxt->num_workers; ++i)
+            if (wkr_atomic_load (cxt->workers [i].deque.bottom) - wkr_atomic_load (cxt->workers [i].deque.top) > 0)
+                return 1;
+
+    return 0;
+}
+
+// Idle workers that have nothing to do (after spinning for a while) park themselves, each on its own
+// "parked" word, until the thread that enqueues a job wakes one of them up. Parking works like the
+// event count above: the worker registers as parked before checking for jobs one last time, and the
+// enqueuing thread puts the job in before checking for parked workers, so a wakeup can never be lost.
+// A parked worker is claimed for waking by clearing its word with a CAS, so each enqueued job wakes a
+// different worker, and with futexes the actual wakeup is a single system call on that worker's word.
+
+static void worker_park (WorkerInfo *thread)
+{
+    Workers *cxt = thread->workers;
+    uint64_t start;
+
+    if (spin_until (cxt, &cxt->idle_stats, job_available, NULL, &start))
+        return;
+
+    wkr_atomic_add (cxt->workers_parked, 1);
+    wkr_atomic_store (thread->parked, 1);
+
+    // If a job showed up after all then we unpark ourselves, unless another thread has already claimed
+    // us to wake up (in which case it has taken care of the count, and its wakeup is just spurious).
+
+    if (job_available (cxt, NULL)) {
+        if (wkr_atomic_cas (thread->parked, 1, 0))
+            wkr_atomic_add (cxt->workers_parked, -1);
+
+        update_wait_stats (&cxt->idle_stats, get_time () - start, 0);
+        return;
+    }
+
+#ifdef WORKERS_FUTEX
+    while (wkr_atomic_load (thread->parked))
+        wkr_futex_wait (thread->parked, 1);
+#else
+    wkr_mutex_obtain (cxt->mutex);
+
+    while (wkr_atomic_load (thread->parked))
+        wkr_condvar_wait (thread->condvar, cxt->mutex);
+
+    wkr_mutex_release (cxt->mutex);
+#endif
+
+    update_wait_stats (&cxt->idle_stats, wkr_atomic_load64 (thread->wake_time) - start, 1);
+}
+
+// Wake up (at most) the specified number of parked workers, preferring the ones on the specified node
+// (if any) because that's where the jobs are. If no workers are parked then this is just a single
+// atomic read.
+
+static void wake_workers (Workers *cxt, WorkerNode *node, int count)
+{
+    uint64_t wake_time;
+    int pass, i;
+
+    if (!wkr_atomic_load (cxt->workers_parked))
+        return;
+
+    wake_time = get_time ();
+
+    for (pass = node ? 0 : 1, i = 0; pass < 2 && count; i = (i + 1) % cxt->num_workers, pass += !i) {
+        WorkerInfo *worker = cxt->workers + i;
+
+        if ((pass == 0) != (worker->node == node) || !wkr_atomic_load (worker->parked))
+            continue;
+
+        // the wake time is stored before the claim so that the woken worker is sure to see it
+
+        wkr_atomic_store64 (worker->wake_time, wake_time);
+
+        if (wkr_atomic_cas (worker->parked, 1, 0)) {
+            wkr_atomic_add (cxt->workers_parked, -1);
+#ifdef WORKERS_FUTEX
+            wkr_futex_wake (worker->parked, 1);
+#else
+            wkr_mutex_obtain (cxt->mutex);
+            wkr_condvar_signal (worker->condvar);
+            wkr_mutex_release (cxt->mutex);
+#endif
+            count--;
+        }
+    }
+}
+
+// Return the node that jobs enqueued with the specified node hint should go to. Without a (valid) hint
+// that's the node of the calling thread: the worker's own node if it's one of our worker threads, and
+// otherwise the node of the processor it's running on right now (which is probably where it has just
+// written the job's data).
+
+static WorkerNode *job_node (Workers *cxt, int node_id)
+{
+    int i;
+
+    if (cxt->num_nodes == 1)
+        return cxt->nodes;
+
+    for (i = 0; i < cxt->num_nodes; ++i)
+        if (cxt->nodes [i].node_id == node_id)
+            return cxt->nodes + i;
+
+    if (current_worker && current_worker->workers == cxt)
+        return current_worker->node;
+
+    i = cpu_node (cxt, current_cpu ());
+    return cxt->nodes + (i < 0 ? 0 : i);
+}
+
+// Jobs enqueued with prerequisites that aren't done yet are held in a list until they are (see
+// workersEnqueueJobAfter()). Each held job waits on one prerequisite at a time, so when a job is done
+// only the held jobs waiting on that one are looked at, and each of those either moves on to its next
+// prerequisite that's not done or is released into its node's ring. Like the wait records, a job is
+// added to the list before its prerequisites are checked one last time, and a job is recorded as done
+// before the list is checked, so a release can never be lost. And if no jobs are being held then
+// release_held_jobs() is just a single atomic read.
+
+static int job_pending (Workers *cxt, uint32_t job_number)
+{
+    WorkerJobStatus status = job_status (cxt, job_number);
+
+    return status == JobQueued || status == JobRunning;
+}
+
+static int held_job_ready (Workers *cxt, WorkerHeldJob *held)
+{
+    const uint32_t *prerequisites = (const uint32_t *) (held + 1);
+
+    while (!job_pending (cxt, held->waiting_on))
+        if (held->next_prerequisite < held->num_prerequisites)
+            held->waiting_on = prerequisites [held->next_prerequisite++];
+        else
+            return 1;
+
+    return 0;
+}
+
+// Put a held job into its node's ring now that its prerequisites are done. Its place was reserved when
+// it was enqueued, so there's always room for it.
+
+static void release_job (Workers *cxt, WorkerHeldJob *held)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+    WorkerJobSpec spec;
+
+    if (held->job.payload_size) {
+        batch.function = held->job.worker_function;
+        batch.payloads = (const char *) &held->job.payload;
+        batch.payload_size = held->job.payload_size;
+    }
+    else {
+        spec.worker_function = held->job.worker_function;
+        spec.worker_job = held->job.worker_job;
+        batch.jobs = &spec;
+    }
+
+    batch.commit = held->job.commit_function;
+    ring_push (held->node, held->job.job_number, &batch, 0, 1);
+    wake_workers (cxt, held->node, 1);
+#ifdef DEBUG
+    enqueues++;
+#endif
+    free (held);
+}
+
+static void hold_job (Workers *cxt, WorkerHeldJob *held)
+{
+    WorkerHeldJob **link;
+    int ready;
+
+    wkr_mutex_obtain (cxt->mutex);
+    wkr_atomic_add (cxt->num_held_jobs, 1);
+
+    if (!(ready = held_job_ready (cxt, held))) {
+        for (link = &cxt->held_jobs; *link; link = &(*link)->next);
+        held->next = NULL;
+        *link = held;
+    }
+    else
+        wkr_atomic_add (cxt->num_held_jobs, -1);
+
+    wkr_mutex_release (cxt->mutex);
+
+    if (ready)
+        release_job (cxt, held);
+}
+
+static void release_held_jobs (Workers *cxt, uint32_t job_number)
+{
+    WorkerHeldJob **link, *held, *released = NULL, **tail = &released;
+
+    if (!wkr_atomic_load (cxt->num_held_jobs))
+        return;
+
+    wkr_mutex_obtain (cxt->mutex);
+
+    for (link = &cxt->held_jobs; (held = *link); )
+        if (held->waiting_on == job_number && held_job_ready (cxt, held)) {
+            *link = held->next;
+            wkr_atomic_add (cxt->num_held_jobs, -1);
+            held->next = NULL;
+            *tail = held;
+            tail = &held->next;
+        }
+        else
+            link = &held->next;
+
+    wkr_mutex_release (cxt->mutex);
+
+    while ((held = released)) {
+        released = held->next;
+        release_job (cxt, held);
+    }
+}
+
+// Return the scratch memory arena for the context passed to a worker function (the worker thread's
+// own arena if it's one of our worker threads, otherwise the calling thread's arena).
+
+static WorkerArena *context_arena (void *context)
+{
+    WorkerInfo *worker = context;
+
+    return worker && worker->worker_number > 0 ? &worker->arena : &caller_arena;
+}
+
+// Take back the scratch memory handed out from the arena since the point where "used" and "overflow"
+// were recorded (which is everything if they're zero and NULL). When everything is taken back from an
+// arena that's allowed to grow, and some of the memory had to be allocated separately, the block is
+// replaced with one big enough for all of it (which is allocated here, by the thread that will use it).
+
+static void arena_release (WorkerArena *arena, size_t used, void *overflow)
+{
+    while (arena->overflow != overflow) {
+        void *next = * (void **) arena->overflow;
+
+        aligned_free (arena->overflow);
+        arena->overflow = next;
+    }
+
+    arena->used = used;
+
+    if (!used && !overflow && arena->overflow_size && arena->grow) {
+        aligned_free (arena->block);
+        arena->block_size += arena->overflow_size;
+
+        if (!(arena->block = aligned_malloc (arena->block_size)))
+            arena->block_size = 0;
+
+        arena->overflow_size = 0;
+    }
+}
+
+// Run a job on the calling thread (rather than as a job picked up by one of our worker threads in the
+// normal way) and take back the scratch memory it got from the arena when it's done. Since the job
+// might itself be running inside another job using the same arena, only what it got is taken back.
+// A job with a payload gets its own copy of it, just as it would on a worker thread, and the job
+// doesn't belong to the group of any job that it's running inside (see group_job()).
+
+static int run_job_here (const WorkerBatch *batch, int index, void *context)
+{
+    WorkerArena *arena = context_arena (context);
+    WorkerGroup *group = current_group;
+    size_t used = arena->used;
+    void *overflow = arena->overflow;
+    WorkerJob job;
+    int result;
+
+    fill_job (&job, batch, index);
+    current_group = NULL;
+    result = job.worker_function (job.payload_size ? &job.payload : job.worker_job, context);
+    current_group = group;
+    arena_release (arena, used, overflow);
+    return result;
+}
+
+// Threads don't just sit there while they wait for something (like a job being done, or room in the
+// queue) but run jobs themselves, taking them just like an idle worker thread would (see find_job()),
+// including from the waiting thread's own deque if it's one of our worker threads (which is where the
+// jobs that its job has enqueued are, so a job that waits for the jobs it enqueued will often simply
+// run them itself). The job gets a worker context of its own so that it runs exactly as it would on a
+// worker thread, including waiting for its turn in workerSync(), and it's done the same way afterward
+// (but it doesn't belong to the group of the job that's waiting, if that's in one, see group_job()).
+// That context has the worker thread's number (or -1 for other threads, which workerNumber() reports
+// as zero) and, on a worker thread, shares its arena (which is only handed back afterward, since the
+// job that's waiting can't use it until then). Jobs can wait inside jobs run this way, and so on, but
+// only up to WORKERS_MAX_HELP_DEPTH deep (after that they simply wait) so that the stack can't overflow.
+//
+// Inside one of our jobs, the only jobs taken from the rings are the ones that come before the job
+// that's waiting, because a later one that called workerSync() would be waiting for the job that's
+// underneath it on the stack. The jobs in the deques were all enqueued from inside jobs (where
+// workerSync() is best avoided anyway, see there) so they can still be taken, and jobs enqueued into
+// the rings from inside jobs only go there when there's an idle worker thread to run them (see
+// enqueue_batch()), so the jobs that a job enqueues and then waits for always get run.
+
+static wkr_thread_local int help_depth;     // number of jobs being run this way on the thread
+
+// Return TRUE if the current thread is running a job from the specified context, either because it's one
+// of its worker threads or because it's running one while it waits.
+
+static int inside_job (Workers *cxt)
+{
+    return (current_worker && current_worker->workers == cxt) || helping == cxt;
+}
+
+// Return the worker context to pass to a job (or loop chunks, or pipeline stages) run right here on the
+// calling thread. Inside one of the specified context's jobs that's the worker context of the job that's
+// running (which has the worker thread's number and the arena that it's using, because while a job is run
+// that way the worker thread's own copy of the arena is out of date), and otherwise it's the context.
+
+static void *here_context (Workers *cxt)
+{
+    if (helping_worker && helping_worker->workers == cxt)
+        return helping_worker;
+
+    return current_worker && current_worker->workers == cxt ? (void *) current_worker : (void *) cxt;
+}
+
+static int run_queued_job (Workers *cxt)
+{
+    WorkerInfo *worker = current_worker && current_worker->workers == cxt ? current_worker : NULL, *outer, *previous_worker, helper;
+    uint32_t before = inside_job (cxt) ? ((WorkerInfo *) here_context (cxt))->job_number : 0;
+    WorkerGroup *group;
+    Workers *previous;
+    WorkerArena *arena;
+    size_t used;
+    void *overflow;
+
+    memset (&helper, 0, sizeof (helper));
+    helper.workers = cxt;
+    helper.cpu = -1;
+
+    // on a worker thread the state comes from the job that's waiting (which might itself be being run
+    // this way, in which case the worker thread's own copy is out of date) and goes back there afterward
+
+    outer = worker ? here_context (cxt) : NULL;
+
+    if (worker) {
+        helper.worker_number = worker->worker_number;
+        helper.node = worker->node;
+        helper.random = outer->random;
+        helper.local_jobs = outer->local_jobs;
+        helper.remote_jobs = outer->remote_jobs;
+        helper.arena = outer->arena;
+        arena = &helper.arena;
+    }
+    else {
+        helper.worker_number = -1;
+        helper.node = job_node (cxt, -1);
+        helper.random = (uint32_t) get_time () | 1;
+        arena = &caller_arena;
+    }
+
+    used = arena->used;
+    overflow = arena->overflow;
+
+    if (!find_job (cxt, &helper, worker ? &worker->deque : NULL, before))
+        return 0;
+
+    previous = helping;
+    helping = cxt;
+    previous_worker = helping_worker;
+    helping_worker = &helper;
+    group = current_group;
+    current_group = NULL;
+    help_depth++;
+
+    if (!job_cancelled (cxt, helper.job_number))
+        set_job_result (cxt, helper.job_number, helper.worker_function (helper.worker_job, &helper));
+
+    arena_release (arena, used, overflow);
+    help_depth--;
+    current_group = group;
+    helping = previous;
+    helping_worker = previous_worker;
+
+    if (worker) {
+        outer->random = helper.random;
+        wkr_atomic_store64 (outer->local_jobs, helper.local_jobs);
+        wkr_atomic_store64 (outer->remote_jobs, helper.remote_jobs);
+        outer->arena = helper.arena;
+    }
+
+    finish_job (cxt, helper.job_number, helper.commit_function, helper.worker_job);
+    release_jobs (cxt, 1);
+    return 1;
+}
+
+// Run jobs (see above) until the specified condition is met (returning TRUE) or there are no more jobs
+// to run (returning FALSE).
+
+static int help_until (Workers *cxt, int (*condition)(Workers *, void *), void *param)
+{
+    if (help_depth >= WORKERS_MAX_HELP_DEPTH)
+        return 0;
+
+    while (run_queued_job (cxt))
+        if (condition (cxt, param))
+            return 1;
+
+    return 0;
+}
+
+// Each worker thread lives forever inside this function / loop. Both Windows API and
+// pthreads API versions are provided. This is where the user-provided function that
+// actually performs the work is called from.
+
+#ifdef _WIN32
+static unsigned WINAPI worker_thread (LPVOID param)
+#else
+static void *worker_thread (void *param)
+#endif
+{
+    WorkerInfo *thread = param;
+    Workers *global = thread->workers;
+
+    // Pin ourselves before doing anything else, so that everything we touch is on the right processor. If we
+    // don't have a processor of our own but are on a NUMA node, then we're pinned to the node's processors.
+
+    if (thread->cpu >= 0) {
+        if (!pin_current_thread (&thread->cpu, 1))
+            thread->cpu = -1;
+    }
+    else if (thread->node->num_cpus)
+        pin_current_thread (thread->node->cpus, thread->node->num_cpus);
+    else if (global->affinity == InheritAffinity)
+        pin_current_thread (NULL, 0);
+
+    current_worker = thread;
+    wkr_atomic_store (thread->state, Ready);
+    wkr_atomic_add (global->workers_ready, 1);
+    wake_waiters (global, &global->workers_ready, 0, 1);    // signal that we're ready to work
+
+    while (1) {
+
+        // If there are jobs waiting then we take the oldest one (see find_job()) and go right to work,
+        // otherwise we wait for something to do (or to be told to quit, but only once the rings are
+        // empty so that any jobs still waiting get done). In work-stealing mode we first look in our
+        // own deque, and if there's nothing there or in the rings we try to steal a job.
+
+        if (!find_job (global, thread, &thread->deque, 0)) {
+            if (wkr_atomic_load (global->quit))
+                break;
+
+            worker_park (thread);
+            continue;
+        }
+
+        wkr_atomic_add (global->workers_ready, -1);
+
+        // jobs that were cancelled before they started are simply dropped (but are otherwise done as usual)
+
+        if (!job_cancelled (global, thread->job_number)) {
+            set_job_result (global, thread->job_number, thread->worker_function (thread->worker_job, thread));
+            arena_release (&thread->arena, 0, NULL);
+        }
+
+#ifdef DEBUG
+        if (A_BEFORE_B (thread->job_number, last_job))
+            unordered++;
+        else
+            last_job = thread->job_number;
+#endif
+
+        wkr_atomic_store (thread->state, Ready);
+        wkr_atomic_add (global->workers_ready, 1);
+        finish_job (global, thread->job_number, thread->commit_function, thread->worker_job);
+        release_jobs (global, 1);                       // signal that we're ready for more work
+    }
+
+    aligned_free (thread->arena.block);
+    wkr_atomic_store (thread->state, Quit);
+    wkr_thread_exit (0);
+    return 0;
+}
+
+// These are the conditions that workerSync() waits on, for the worker thread and user thread
+// cases respectively. For the first case, it's the job's turn when every earlier job is done,
+// which is exactly when the commit ticket gets to its job number.
+
+static int job_turn (Workers *cxt, void *param)
+{
+    return wkr_atomic_load (cxt->commit_ticket) == * (uint32_t *) param;
+}
+
+static int all_jobs_done (Workers *cxt, void *param)
+{
+    (void) param;
+    return !wkr_atomic_load (cxt->jobs_pending) && !wkr_atomic_load (cxt->commits_pending);
+}
+
+// This function is only called from within the user-provided function that performs the
+// work. After this function is called (using the second void pointer passed into the
+// work function) it is guaranteed that all previously enqueued jobs have run to
+// completion and that the rest of the code in the job will run single-threaded (i.e.,
+// no future job will be allowed into this section until after this job has run to
+// completion). This is provided for applications that require that the results of the
+// work be handled in the order that the jobs are enqueued, including things like
+// race-free updating of global variables or writing the results to a file. A job waiting
+// here sleeps until the commit ticket (the oldest job not done yet) gets to its own job
+// number, so this costs the same regardless of the number of workers, and each job that
+// completes wakes only the job next in line.
+//
+// Note that in the work-stealing mode, jobs enqueued from inside worker functions can run in
+// any order, so a worker thread waiting here for an earlier job might be waiting for a job that
+// has not even started yet. This is still correct, but if ALL the worker threads end up waiting
+// here then nobody is left to run the earlier job, so workerSync() is best avoided for jobs
+// that are enqueued from inside worker functions.
+
+void workerSync (void *context)
+{
+    Workers *global = context;
+
+    // First we handle the case where this was actually running on a worker thread. For
+    // that case we must wait until all previous jobs are completed. However later jobs
+    // and a job running on the user's thread can continue.
+
+    // Note that we must not run any other jobs while we wait here (see help_until()), because they
+    // would be later jobs, and if they called workerSync() they would be waiting for us.
+
+    if (global && global->worker_number) {
+        WorkerInfo *info = context;
+        int depth = help_depth;
+
+        help_depth = WORKERS_MAX_HELP_DEPTH;
+        wait_until (info->workers, &info->workers->commit_ticket, &info->job_number, job_turn, &info->job_number);
+        help_depth = depth;
+    }
+
+    // The second case is where this is running on the user's thread, not on a worker thread.
+    // For this case we must wait until ALL worker threads are completed (and the queue is empty).
+
+    else if (global)
+        wait_until (global, &global->jobs_pending, NULL, all_jobs_done, NULL);
+
+    // A final case is also handled where this is running without any worker threads at all,
+    // indicated by the passed pointer being NULL. Obviously there's nothing to do then.
+}
+
+// Return the number of the worker thread that the job is running on, from 1 to the number of worker
+// threads, or zero if it's not running on one of the worker threads (i.e., it's running on the user's
+// thread). This is only called from within the user-provided function that performs the work (using
+// the second void pointer passed into the work function) and it's stable for the life of the worker
+// thread manager, so it can be used to index arrays of per-thread data (with one extra for the user's
+// thread) that can then be used without any synchronization.
+
+int workerNumber (void *context)
+{
+    WorkerInfo *worker = context;
+
+    return worker && worker->worker_number > 0 ? worker->worker_number : 0;
+}
+
+// Return TRUE if the job that's running has been cancelled (see workersCancelJob()), in which case it
+// should stop what it's doing and return as soon as it can. This is only called from within the user-
+// provided function that performs the work (using the second void pointer passed into the work function)
+// and it's just a single lookup, so a long job can call it often. Jobs running on the user's thread can't
+// be cancelled (see workersCancelJob()), so it always returns FALSE for them.
+
+int workerCancelled (void *context)
+{
+    WorkerInfo *worker = context;
+
+    if (current_group && wkr_atomic_load (current_group->cancelled))
+        return 1;
+
+    if (!worker || !worker->worker_number)
+        return 0;
+
+    return job_cancelled (worker->workers, worker->job_number);
+}
+
+// These functions return scratch memory for the job that's running, either uninitialized or zeroed
+// like malloc() and calloc(). They're only called from within the user-provided function that performs
+// the work (using the second void pointer passed into the work function, or the last one passed into
+// the loop function of workersParallelFor()) and the memory is automatically freed when the job (or
+// the chunk of the loop) is done, so it must not be freed by the job, or kept around after the job.
+// The memory is aligned to at least 16 bytes, and NULL is returned if it can't be allocated.
+//
+// On the worker threads the memory comes from the worker's own arena, which is simply a block of
+// memory that's handed out in order and taken back all at once when the job is done. The block grows
+// to fit the largest amount that's been needed (so it's only allocated the first few times) and it's
+// allocated by the worker thread itself, so it's also likely to stay in that processor's caches (and
+// on its NUMA node). Jobs that run on the user's thread get their memory allocated individually.
+
+void *workerAlloc (void *context, size_t size)
+{
+    WorkerArena *arena = context_arena (context);
+    void **overflow;
+    char *ptr;
+
+    size = (size + WORKERS_ARENA_ALIGN - 1) & ~(size_t) (WORKERS_ARENA_ALIGN - 1);
+
+    if (arena->block && arena->block_size - arena->used >= size) {
+        ptr = arena->block + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+
+    // didn't fit, so allocate it separately (with the link to the next one in the first cache line)
+
+    if (!(overflow = aligned_malloc (size + WORKERS_CACHE_LINE)))
+        return NULL;
+
+    *overflow = arena->overflow;
+    arena->overflow = overflow;
+    arena->overflow_size += size;
+    return (char *) overflow + WORKERS_CACHE_LINE;
+}
+
+void *workerCalloc (void *context, size_t num, size_t size)
+{
+    void *ptr;
+
+    if (size && num > (size_t) -1 / size)
+        return NULL;
+
+    if ((ptr = workerAlloc (context, num * size)))
+        memset (ptr, 0, num * size);
+
+    return ptr;
+}
+
+static int all_workers_ready (Workers *cxt, void *param)
+{
+    (void) param;
+    return wkr_atomic_load (cxt->workers_ready) == cxt->num_workers;
+}
+
+// Initialize the worker thread manager and spin up all the workers. There is no limit here
+// imposed on the number of workers, but the underlying operating system and the machine's
+// resources may certainly impose limits. Note that there is no issue creating more workers
+// than the machine has cores, although the number of machine cores (or hyperthreads) is
+// obviously a good starting point for experimentation.
+//
+// It is also possible to call this function specifying zero threads, which basically does
+// nothing except return a NULL pointer. Interestingly though, this is valid and the rest
+// of the manager's functionality is still perfectly usable and all requested jobs will
+// simply be completed on the user's calling thread (which will block until the job is
+// done). This is different from the case of specifying a single worker thread, which
+// allows single jobs to run in the background while the user's thread immediately
+// returns to the user.
+//
+// Workers created with this function have no job queue, so jobs are handed directly to
+// idle worker threads and workersEnqueueJob() will block (with the default policy) when
+// all the workers are busy. See workersInitQueue() to create workers with a queue, and
+// workersInitConfig() for the other options.
+
+Workers *workersInit (int numWorkerThreads)
+{
+    return workersInitQueue (numWorkerThreads, 0);
+}
+
+// Initialize the worker thread manager with a queue of the specified depth for jobs that
+// are waiting for a worker thread. When all the worker threads are busy, jobs that are
+// enqueued go into the queue (and workersEnqueueJob() returns immediately) until the
+// queue is full, and only then does the caller block (or not, depending on the policy).
+// When a worker thread finishes a job it takes the next one from the queue directly,
+// so there is no idle gap between jobs while the queue has work in it.
+//
+// The queue entries are small (just the worker function, the job pointer and the job
+// number) so a deep queue costs little, however the jobs themselves presumably hold
+// resources that are owned by the caller, so this also limits how many of those can be
+// waiting around at once. A queueDepth of zero gives the same behavior as workersInit().
+//
+// Internally, even the zero-depth case uses the ring to pass jobs to the workers, and the
+// ring is sized to hold a job for every worker thread plus the queue depth (rounded up to
+// a power of two).
+
+Workers *workersInitQueue (int numWorkerThreads, int queueDepth)
+{
+    WorkersConfig config = { 0 };
+
+    config.num_workers = numWorkerThreads;
+    config.queue_depth = queueDepth;
+    config.scheduling = SharedQueueScheduling;
+
+    return workersInitConfig (&config);
+}
+
+// Initialize the worker thread manager with the configuration specified in the WorkersConfig
+// structure. This is the most general form, and the other init functions simply call this.
+// In addition to the number of workers and the queue depth, the scheduling mode is selected:
+//
+//     SharedQueueScheduling:       This is the default (and original) mode. All jobs go through
+//                                  the shared queue and are started in the order enqueued.
+//
+//     WorkStealingScheduling:      In this mode each worker thread also has its own deque. Jobs
+//                                  that are enqueued from inside a worker function (with any
+//                                  policy except DontUseWorkerThread) go into that worker's deque
+//                                  without waiting for room in the queue, and the worker runs them
+//                                  itself (most recent first) when its current job is done. Idle
+//                                  workers steal the oldest jobs from the deques of other workers
+//                                  (starting at a random victim). This is the standard way to scale
+//                                  recursive or "fan-out" workloads because the workers rarely
+//                                  contend with each other. Jobs enqueued from outside the worker
+//                                  functions still go through the shared queue.
+//
+// The worker threads can also be pinned to processors, which keeps the OS scheduler from moving
+// them around (and throwing away what they've built up in the caches of the processor they were
+// on). Each thread pins itself when it starts, and the placement that was chosen can be retrieved
+// with workersGetPlacement(). The affinity policies are:
+//
+//     NoAffinity:                  This is the default. The threads are not pinned and inherit the
+//                                  affinity of the thread calling this function.
+//
+//     CompactAffinity:             The threads are placed on consecutive processors of the allowed
+//                                  ones, filling each core (i.e., its hyperthreads) and then each
+//                                  package before moving on, so that threads sharing data also
+//                                  share caches.
+//
+//     ScatterAffinity:             The threads are spread across the packages and cores first, and
+//                                  only share cores once every core has a thread, so that each
+//                                  thread gets as much cache (and memory bandwidth) as possible.
+//
+//     ListAffinity:                The threads are placed on the processors in the supplied list,
+//                                  in order, starting over at the beginning if the list runs out.
+//
+//     InheritAffinity:             The threads are not pinned to individual processors, but are
+//                                  allowed to run on every processor in the process affinity mask
+//                                  (which is different from NoAffinity only when the calling thread
+//                                  has been restricted to fewer processors).
+//
+// The compact and scatter placements only use the processors the process is allowed to run on, and
+// wrap around if there are more threads than processors. Pinning is supported on Windows (the first
+// 64 processors only) and Linux, and elsewhere the policy is ignored.
+//
+// Finally, on machines with more than one NUMA node (i.e., more than one socket) the worker threads
+// can be divided among the nodes by setting "numa_aware". Each node then gets its own queue, and jobs
+// go into the queue of the node they're meant for (see workersEnqueueJobsOnNode()), which by default
+// is the node that the calling thread is running on. The worker threads take jobs from their own node
+// first, and only run jobs meant for other nodes (or steal from the deques of worker threads on other
+// nodes) when there's nothing left for their own node. The worker threads that are pinned to processors
+// belong to those processors' nodes, and the others are spread over the nodes in proportion to their
+// number of processors and pinned to all the processors of their node. The nodes are found in the
+// /sys/devices/system/node directory on Linux (and with the NUMA functions on Windows), and the counts
+// of the jobs run locally and remotely on each node are returned by workersGetNodeStats().
+
+Workers *workersInitConfig (const WorkersConfig *config)
+{
+    uint32_t i;
+    Workers *cxt;
+
+    if (config->num_workers <= 0)   // if no worker threads, just return NULL pointer
+        return NULL;                // (this is a valid use case and still works)
+
+    // initialize the main structure of the worker manager
+
+    cxt = aligned_calloc (1, sizeof (Workers));
+    cxt->workers = aligned_calloc (cxt->num_workers = config->num_workers, sizeof (WorkerInfo));
+    cxt->queue_depth = config->queue_depth > 0 ? config->queue_depth : 0;
+    cxt->scheduling = config->scheduling;
+    cxt->affinity = config->affinity;
+    cxt->job_table = aligned_calloc (WORKERS_JOB_TABLE_SIZE, sizeof (uint64_t));
+    cxt->skip_table = aligned_calloc (WORKERS_JOB_TABLE_SIZE, sizeof (uint32_t));
+    cxt->job_results = aligned_calloc (WORKERS_JOB_TABLE_SIZE, sizeof (uint64_t));
+    cxt->cancel_table = aligned_calloc (WORKERS_JOB_TABLE_SIZE, sizeof (uint32_t));
+    cxt->commit_table = aligned_calloc (WORKERS_JOB_TABLE_SIZE, sizeof (WorkerCommit));
+    cxt->idle_stats.wait_time = cxt->wait_stats.wait_time = WORKERS_MAX_SPIN / 4;
+    cxt->max_spin = get_num_processors () > 1 ? WORKERS_MAX_SPIN : 0;
+    wkr_mutex_init (cxt->mutex);
+    choose_placement (cxt, config);
+    assign_nodes (cxt, config);
+
+    // initialize and start each worker thread
+
+    for (i = 0; i < (uint32_t) config->num_workers; ++i) {
+        cxt->workers [i].workers = cxt;
+        cxt->workers [i].worker_number = i + 1;
+        cxt->workers [i].random = (i + 1) * 2654435761U;
+        cxt->workers [i].arena.grow = 1;
+#ifndef WORKERS_FUTEX
+        wkr_condvar_init (cxt->workers [i].condvar);
+#endif
+
+        if (cxt->scheduling == WorkStealingScheduling) {
+            cxt->workers [i].deque.jobs = aligned_calloc (WORKERS_DEQUE_SIZE, sizeof (WorkerJob));
+            cxt->workers [i].deque.mask = WORKERS_DEQUE_SIZE - 1;
+        }
+
+        wkr_thread_create (cxt->workers [i].thread, worker_thread, &cxt->workers [i]);
+
+        // gracefully handle failures in creating worker threads
+
+        if (!cxt->workers [i].thread) {
+            aligned_free (cxt->workers [i].deque.jobs);
+#ifndef WORKERS_FUTEX
+            wkr_condvar_delete (cxt->workers [i].condvar);
+#endif
+            while (cxt->num_workers > (int) i)
+                cxt->workers [--cxt->num_workers].node->num_workers--;
+
+            break;
+        }
+    }
+
+    if (!cxt->num_workers) {    // if we failed to start any workers, free the arrays
+        aligned_free (cxt->workers);
+        cxt->workers = NULL;
+        free_nodes (cxt);
+        aligned_free (cxt->job_table);
+        cxt->job_table = NULL;
+        aligned_free (cxt->skip_table);
+        cxt->skip_table = NULL;
+        aligned_free (cxt->job_results);
+        cxt->job_results = NULL;
+        aligned_free (cxt->cancel_table);
+        cxt->cancel_table = NULL;
+        aligned_free (cxt->commit_table);
+        cxt->commit_table = NULL;
+        wkr_mutex_delete (cxt->mutex);
+        aligned_free (cxt);
+        return NULL;
+    }
+
+    // wait for all worker threads to get to the "Ready" state
+
+    wait_until (cxt, &cxt->workers_ready, NULL, all_workers_ready, NULL);
+
+    return cxt;
+}
+
+// Get the specified number of consecutive job numbers (which start out "Queued" in the job table),
+// none of which can be zero (if the range would include zero then we just start over at 1, which is
+// fine because gaps in the job numbers are harmless and this only happens once every four billion
+// jobs or so, and the skipped numbers are simply passed over). The job numbers must also all have
+// entries in the job table that can be taken (see claim_job_entry()), so if any doesn't then the range
+// is moved past it, and in the rare case that one is taken by somebody else in the meantime we pass
+// over the whole range and start again. Finally, job numbers are only given out within
+// WORKERS_JOB_NUMBER_SPAN of the commit ticket (so that they can always be compared), so this has the
+// form of a wait condition (like reserve_jobs() below) and when there's no room it stores the ticket
+// value that has to be reached before it's worth trying again. If there's no room then we wait for it,
+// but only until the specified deadline (which can be zero to not wait at all, or WORKERS_NO_DEADLINE)
+// after which zero is returned.
+
+typedef struct {
+    int count;                  // number of consecutive job numbers wanted
+    uint32_t first_job;         // the first of the job numbers (when successful)
+    uint32_t ticket;            // commit ticket value to wait for (when not)
+} WorkerNumbering;
+
+// Return TRUE if the job table entry for the specified job number looks like it can be taken (see
+// claim_job_entry()), without actually taking it.
+
+static int job_entry_free (Workers *cxt, uint32_t job_number, uint32_t ticket)
+{
+    return job_number - ticket < WORKERS_JOB_TABLE_SIZE ||
+        (wkr_atomic_load64 (cxt->job_table [job_number & (WORKERS_JOB_TABLE_SIZE - 1)]) & 0xffffffff) == JobDone;
+}
+
+static int allocate_job_numbers (Workers *cxt, void *param)
+{
+    uint32_t job_number = wkr_atomic_load (cxt->job_number), first_job, ticket;
+    WorkerNumbering *numbering = param;
+    int i;
+
+    while (1) {
+        ticket = wkr_atomic_load (cxt->commit_ticket);
+        first_job = job_number;
+
+        for (i = 0; i < numbering->count && first_job + i - ticket < WORKERS_JOB_NUMBER_SPAN; ++i)
+            if (!first_job || first_job + numbering->count - 1 < first_job)
+                first_job = 1, i = -1;
+            else if (!job_entry_free (cxt, first_job + i, ticket))
+                first_job += i + 1, i = -1;
+
+        if (first_job + numbering->count - ticket > WORKERS_JOB_NUMBER_SPAN) {
+            numbering->ticket = ticket + 1;
+            return 0;
+        }
+
+        if (wkr_atomic_cas (cxt->job_number, job_number, first_job + numbering->count))
+            break;
+
+        job_number = wkr_atomic_load (cxt->job_number);
+    }
+
+    while (job_number != first_job)
+        pass_job_number (cxt, job_number++, ticket);
+
+    for (i = 0; i < numbering->count; ++i)
+        if (!claim_job_entry (cxt, first_job + i, JobQueued, ticket)) {
+            for (job_number = first_job + i; i < numbering->count; ++i)
+                pass_job_number (cxt, first_job + i, ticket);
+
+            while (first_job != job_number)
+                commit_job (cxt, first_job++);
+
+            return allocate_job_numbers (cxt, param);
+        }
+
+    numbering->first_job = first_job;
+    return 1;
+}
+
+static uint32_t next_job_numbers (Workers *cxt, int count, uint64_t deadline)
+{
+    WorkerNumbering numbering = { count, 0, 0 };
+
+    if (allocate_job_numbers (cxt, &numbering))
+        return numbering.first_job;
+
+    if (deadline)
+        wait_until_deadline (cxt, &cxt->commit_ticket, &numbering.ticket, allocate_job_numbers, &numbering, deadline);
+
+    return numbering.first_job;
+}
+
+// Reserve places for jobs, either idle worker threads or spots in the queue. The number of places
+// reserved will be between the specified minimum and maximum, and on success TRUE is returned and
+// the number actually reserved is stored. This is what guarantees that there's always room in the
+// ring for the jobs pushed into it. Note that this has the form of an event condition so that we
+// can wait on it, and because it has a side effect the reservation is only made when it returns
+// TRUE (which ends the wait). Jobs enqueued from inside our jobs only get idle worker threads, not
+// spots in the queue, because a job that waits inside a job can't run later jobs from the queue
+// (see run_queued_job()), so if all the worker threads were doing that, nobody would run them.
+
+typedef struct {
+    int minimum, maximum, reserved;
+    int workers_only;               // only reserve idle worker threads (for jobs enqueued inside jobs)
+} WorkerReservation;
+
+static int reserve_jobs (Workers *cxt, void *param)
+{
+    int pending = wkr_atomic_load (cxt->jobs_pending), room;
+    WorkerReservation *reservation = param;
+    int depth = reservation->workers_only ? 0 : cxt->queue_depth;
+
+    while ((room = cxt->num_workers + depth - pending) >= reservation->minimum) {
+        if (room > reservation->maximum)
+            room = reservation->maximum;
+
+        if (wkr_atomic_cas (cxt->jobs_pending, pending, pending + room)) {
+            reservation->reserved = room;
+            return 1;
+        }
+
+        pending = wkr_atomic_load (cxt->jobs_pending);
+    }
+
+    return 0;
+}
+
+// This is the function that enqueues a job to be completed, potentially by a worker thread
+// or, in some situations, on the calling thread (see "policy" below).
+//
+// The arguments are:
+//
+// cxt:             Context pointer returned by workersInit();
+//
+// WorkerFunction:  Pointer to the function that will be called to actually do the work. The
+//                  arguments are two void pointers. The first pointer is a pointer to the
+//                  user-defined area that describes the work and possibly provides a place
+//                  to return the results of the work. The second pointer passed in is an
+//                  opaque pointer used by the worker function to call the workerSync()
+//                  function (if desired).
+//
+// WorkerJob:       This is an opaque (to the manager, anyway) pointer that is user-defined
+//                  and descibes the work to be performed. It may contain fields to return
+//                  results or status also if required, and also things like a "stop" flag
+//                  for terminating early. The area pointed to is owned by the caller. It
+//                  obviously may contain pointers to other areas also owned by the caller.
+//                  It might make sense to have the worker function free the pointer on
+//                  completetion, or it might make sense for the caller to free it when the
+//                  results have been extracted from it. In any event, this is the pointer
+//                  that is passed into the worker function as the first argument.
+//
+// policy:          This enum controls the execution policy for the individual job, thus:
+//
+//     WaitForAvailableWorkerThread:    This is the most common case and simply requests that the
+//                                      job be given to the next available worker thread (or put in
+//                                      the queue, if there is one with room in it). The function
+//                                      will block if there isn't a worker thread or queue entry
+//                                      available but will otherwise return immediately. It will not
+//                                      block and execute the job on the user's thread unless there
+//                                      are no worker threads at all (the numWorkers == zero case),
+//                                      or it's being called from inside a worker function running
+//                                      on one of the worker threads (see below).
+//
+//     UseWorkerThreadOnlyIfAvailable:  Similar to the above case, except that if there is no
+//                                      available worker thread (and no room in the queue, if there
+//                                      is one) the job is executed on the caller's thread (which
+//                                      blocks, obviously). This policy might be useful if there are
+//                                      very few worker threads or for the last job in a batch of jobs
+//                                      where we have to wait until the others have completed anyway
+//                                      (so there's nothing else for the user's thread to do).
+//
+//     DontUseWorkerThread:             Execute the job on the current thread regardless of available
+//                                      worker threads.
+//
+//     FailOnNoWorkerThreadAvailable:   Return failure (0) and do nothing if no worker threads are
+//                                      currently available (and there is no room in the queue, if
+//                                      there is one). This is the only policy that cannot block
+//                                      and the only policy that can fail. It's also the only policy
+//                                      that can result in a job not being started. Note that in the
+//                                      special numWorkers == zero case this policy acts like all the
+//                                      others and simply executes the job on the caller's thread and
+//                                      returns 1.
+//
+// returns:         Zero for failure, otherwise a non-zero job number. In the numWorkers == zero /
+//                  NULL context case, 1 is returned after the task executes to completetion.
+//
+// Jobs can be enqueued from inside worker functions (for example, by recursive divide-and-conquer
+// algorithms). In the work-stealing mode (see workersInitConfig()) these go into the calling worker's
+// own deque instead of the queue, so they never block. Otherwise, or if the deque is full, they go
+// through the queue like any other job, except that a worker thread never waits for an available
+// worker thread (because it might be waiting for itself) so with WaitForAvailableWorkerThread the
+// job is executed right there if there's no idle worker thread for it (just like
+// UseWorkerThreadOnlyIfAvailable, which doesn't use room in the queue inside a job either).
+//
+// When the calling thread has to wait for a worker thread or room in the queue, it doesn't just sit
+// idle but runs queued jobs itself until there's room. This also applies to the other functions that
+// wait (except the ones with deadlines, and workerSync()), like workersWaitOnJob(), so a job that
+// waits for the jobs that it has enqueued doesn't tie up its worker thread (it will often just end up
+// running them itself). These jobs run exactly like they would on a worker thread (including the
+// ordering of workerSync()) except that workerNumber() returns zero for them on other threads. Inside
+// a job, the only jobs from the queue run this way are the ones enqueued before it (the ones in the
+// work-stealing deques can always be run), so a later job waiting for its turn in workerSync() never
+// ends up on top of it.
+//
+// Note that this is nominally thread-safe and could conceivably be safely called from multiple threads.
+// However, use caution as this breaks some of the functionality. For example, if policies are used
+// that result in jobs being done on the user's thread, having multiple jobs running on the user's
+// thread might happen, and this would break the workerSync() functionality. Also, if this is being
+// called on multiple threads then calling a function like workersNumAvailableWorkers() might end up
+// indicating a worker was available which might be no longer be available before trying to enqueue a
+// job on the same thread.
+
+
+static uint32_t enqueue_batch (Workers *cxt, int node, const WorkerBatch *batch, int numJobs, WorkerPolicy policy, uint64_t deadline);
+
+uint32_t workersEnqueueJob (Workers *cxt, int (*workerFunction)(void *, void *), void *workerJob, WorkerPolicy policy)
+{
+    return workersEnqueueJobOnNode (cxt, -1, workerFunction, workerJob, policy);
+}
+
+// This is the same as workersEnqueueJob() with the WaitForAvailableWorkerThread policy, except that it
+// only waits for an available worker thread (or room in the queue) until the specified deadline, and
+// returns zero (without doing anything) if there's still none then. The deadline is in nanoseconds on
+// the same monotonic clock as workersGetTime(), so a timeout is simply added to the current time.
+
+uint32_t workersEnqueueJobUntil (Workers *cxt, int (*workerFunction)(void *, void *), void *workerJob, uint64_t deadline)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+    WorkerJobSpec job;
+
+    job.worker_function = workerFunction;
+    job.worker_job = workerJob;
+    batch.jobs = &job;
+
+    return enqueue_batch (cxt, -1, &batch, 1, WaitForAvailableWorkerThread, deadline);
+}
+
+// These are the same as workersEnqueueJob() and workersEnqueueJobs() except that the jobs also have a
+// commit function, which is passed the job pointer once the job is done and is run strictly in job
+// number order. This is an alternative to calling workerSync() at the end of each job for work that's
+// parallel except for a final step that has to be done in order (like writing each slice to a file):
+// instead of tying up a worker thread until all the earlier jobs are done (so that one slow job can hold
+// up every worker thread behind it) the commit simply waits in the job table, and is run by whichever
+// thread finishes the last job before it (or advances the commit ticket to it). So no thread ever waits
+// for a commit, and commit functions never run at the same time as each other. They should be short,
+// because they hold up all the later commits (but not the later jobs). A job isn't done (for waits,
+// workersIsJobRunning(), prerequisites and so on) until its commit function has run, and a job that's
+// cancelled before then doesn't get its commit. The commit function can enqueue more jobs (but it never
+// waits for room to do so, just as inside a job) but it must not wait for later jobs to be done.
+
+uint32_t workersEnqueueJobCommit (Workers *cxt, int (*workerFunction)(void *, void *), void (*commitFunction)(void *),
+    void *workerJob, WorkerPolicy policy)
+{
+    WorkerJobSpec job;
+
+    job.worker_function = workerFunction;
+    job.worker_job = workerJob;
+
+    return workersEnqueueJobsCommit (cxt, &job, 1, commitFunction, policy);
+}
+
+uint32_t workersEnqueueJobsCommit (Workers *cxt, const WorkerJobSpec *jobs, int numJobs, void (*commitFunction)(void *),
+    WorkerPolicy policy)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+
+    batch.jobs = jobs;
+    batch.commit = commitFunction;
+    return enqueue_batch (cxt, -1, &batch, numJobs, policy, WORKERS_NO_DEADLINE);
+}
+
+// Enqueue a batch of jobs in a single call. The jobs are specified in an array of WorkerJobSpec
+// structures, each with the worker function and job pointer exactly as passed to workersEnqueueJob()
+// (and in fact workersEnqueueJob() simply calls this with a single job). The jobs get consecutive job
+// numbers, which are reserved with a single atomic operation, and the first job number is returned
+// (or zero on failure). The jobs are enqueued in order, so workerSync() and workersWaitOnJob() work
+// exactly as if the jobs had been enqueued one at a time.
+//
+// The policies work the same as they do for a single job, with the jobs that can't be given to worker
+// threads (or put in the queue) either waited for, executed on the caller's thread, or (in the case of
+// FailOnNoWorkerThreadAvailable) causing the whole batch to fail. For that last policy there must be
+// room for all the jobs at once or nothing is done, which means that the batch must not be larger than
+// the number of workers plus the queue depth. Note that as many jobs as possible are put into the ring
+// at once, and only as many sleeping worker threads are woken as there are jobs for them to do.
+
+uint32_t workersEnqueueJobs (Workers *cxt, const WorkerJobSpec *jobs, int numJobs, WorkerPolicy policy)
+{
+    return workersEnqueueJobsOnNode (cxt, -1, jobs, numJobs, policy);
+}
+
+// These are the same as workersEnqueueJob() and workersEnqueueJobs() except that instead of a pointer
+// to the work "data", a copy of the data (the "payload") is enqueued with the job, and the worker
+// function gets a pointer to its own copy. This means that small jobs don't need anything allocated
+// (or freed) for them at all, and the payload can simply be a structure on the caller's stack. The
+// copy passed to the worker function is aligned for any basic type and can be modified (but it's gone
+// when the job is done, so results have to go somewhere else). The payload size can be from 1 to
+// WORKERS_PAYLOAD_SIZE bytes, and zero is returned (without doing anything) if it's not. For the batch
+// version the payloads are packed in an array (i.e., they're all the same size) and all the jobs use
+// the same worker function.
+
+uint32_t workersEnqueueJobCopy (Workers *cxt, int (*workerFunction)(void *, void *), const void *payload, int payloadSize, WorkerPolicy policy)
+{
+    return workersEnqueueJobsCopy (cxt, workerFunction, payload, payloadSize, 1, policy);
+}
+
+
+uint32_t workersEnqueueJobsCopy (Workers *cxt, int (*workerFunction)(void *, void *), const void *payloads, int payloadSize,
+    int numJobs, WorkerPolicy policy)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+
+    if (payloadSize < 1 || payloadSize > WORKERS_PAYLOAD_SIZE)
+        return 0;
+
+    batch.function = workerFunction;
+    batch.payloads = payloads;
+    batch.payload_size = payloadSize;
+
+    return enqueue_batch (cxt, -1, &batch, numJobs, policy, WORKERS_NO_DEADLINE);
+}
+
+// These are the same as workersEnqueueJob() and workersEnqueueJobs() except that the jobs are meant for
+// the specified NUMA node (using the operating system's node number, which is presumably where the jobs'
+// data lives). They go into that node's queue, and worker threads on that node are woken for them first.
+// Worker threads on other nodes only run them when they have nothing of their own to do. A node of -1 (or
+// one that we don't have) means the node of the calling thread, which is what the versions without the
+// node argument use. Without NUMA awareness (see workersInitConfig()) the node is simply ignored.
+
+uint32_t workersEnqueueJobOnNode (Workers *cxt, int node, int (*workerFunction)(void *, void *), void *workerJob, WorkerPolicy policy)
+{
+    WorkerJobSpec job;
+
+    job.worker_function = workerFunction;
+    job.worker_job = workerJob;
+
+    return workersEnqueueJobsOnNode (cxt, node, &job, 1, policy);
+}
+
+uint32_t workersEnqueueJobsOnNode (Workers *cxt, int node, const WorkerJobSpec *jobs, int numJobs, WorkerPolicy policy)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+
+    batch.jobs = jobs;
+    return enqueue_batch (cxt, node, &batch, numJobs, policy, WORKERS_NO_DEADLINE);
+}
+
+// This is the common code for all the enqueue functions (see workersEnqueueJob() for the details). The
+// waits for job numbers or for room give up at the specified deadline (see workersEnqueueJobUntil()), in
+// which case zero is returned and any jobs not enqueued yet are dropped (which is why only single jobs
+// are ever enqueued with a deadline).
+
+static uint32_t enqueue_batch (Workers *cxt, int node, const WorkerBatch *batch, int numJobs, WorkerPolicy policy, uint64_t deadline)
+{
+    WorkerReservation reservation = { 0, 0, 0, 0 };
+    uint32_t first_job = 0;
+    WorkerNode *target;
+    int done = 0;
+
+    if (numJobs <= 0)
+        return 0;
+
+    // handle the unitialized numWorkers == zero case by simply executing the jobs and returning one
+
+    if (!cxt) {
+        for (done = 0; done < numJobs; ++done) {
+            run_job_here (batch, done, cxt);
+
+            if (batch->commit)
+                batch->commit (batch->jobs [done].worker_job);
+        }
+
+        return 1;
+    }
+
+    // A worker thread (or any thread running one of our jobs) must never wait for an available worker thread
+    // (or room in the queue) because it might be waiting for itself (if all the others are doing the same
+    // thing) so if there's no room then it simply does the jobs itself. Only idle worker threads count as
+    // room in that case (see reserve_jobs()).
+
+    if (inside_job (cxt)) {
+        reservation.workers_only = 1;
+
+        if (policy == WaitForAvailableWorkerThread)
+            policy = UseWorkerThreadOnlyIfAvailable;
+    }
+
+    // batches too big for the job table (see allocate_job_numbers()) are enqueued in pieces, which still
+    // get consecutive job numbers unless other threads are enqueuing jobs at the same time
+
+    if (numJobs > WORKERS_JOB_TABLE_SIZE / 2 && policy != FailOnNoWorkerThreadAvailable) {
+        WorkerBatch rest = *batch;
+
+        if (rest.payloads)
+            rest.payloads += (size_t) rest.payload_size * (WORKERS_JOB_TABLE_SIZE / 2);
+        else
+            rest.jobs += WORKERS_JOB_TABLE_SIZE / 2;
+
+        first_job = enqueue_batch (cxt, node, batch, WORKERS_JOB_TABLE_SIZE / 2, policy, deadline);
+        enqueue_batch (cxt, node, &rest, numJobs - WORKERS_JOB_TABLE_SIZE / 2, policy, deadline);
+        return first_job;
+    }
+
+    target = job_node (cxt, node);
+
+    // In work-stealing mode, jobs enqueued from inside one of our worker functions go into that worker's
+    // deque (unless they don't fit, or are meant for another node) and sleeping workers are woken in case
+    // they can steal them. Note that the jobs are counted as pending before they're pushed, because once
+    // pushed they could be done.
+
+    if (cxt->scheduling == WorkStealingScheduling && policy != DontUseWorkerThread &&
+        current_worker && current_worker->workers == cxt && current_worker->node == target) {
+            if (!(first_job = next_job_numbers (cxt, numJobs, policy != FailOnNoWorkerThreadAvailable ? deadline : 0)))
+                return 0;
+
+            wkr_atomic_add (cxt->jobs_pending, numJobs);
+
+            if (deque_push (&current_worker->deque, first_job, batch, numJobs)) {
+                wake_workers (cxt, target, numJobs);
+#ifdef DEBUG
+                enqueues += numJobs;
+#endif
+                return first_job;
+            }
+
+            release_jobs (cxt, numJobs);
+    }
+
+    // Handle the FailOnNoWorkerThreadAvailable policy by returning zero if there isn't room for all the jobs
+    // (or there aren't job numbers available without waiting). If we already got job numbers for the jobs
+    // (above) then they must be recorded as done, because otherwise they would hold up the commit ticket.
+
+    if (policy == FailOnNoWorkerThreadAvailable) {
+        reservation.minimum = reservation.maximum = numJobs;
+
+        if (reserve_jobs (cxt, &reservation) && !first_job && !(first_job = next_job_numbers (cxt, numJobs, 0))) {
+            release_jobs (cxt, numJobs);
+            reservation.reserved = 0;
+        }
+
+        if (!reservation.reserved) {
+            while (first_job && done < numJobs)
+                commit_job (cxt, first_job + done++);
+#ifdef DEBUG
+            failures++;
+#endif
+            return 0;
+        }
+    }
+
+    if (!first_job && !(first_job = next_job_numbers (cxt, numJobs, deadline)))
+        return 0;
+
+    while (done < numJobs) {
+
+        // Unless we're going to do the job right here anyway, try to reserve places for as many of the
+        // remaining jobs as possible (either idle worker threads or room in the queue).
+
+        if (!reservation.reserved && policy != DontUseWorkerThread) {
+            reservation.minimum = 1;
+            reservation.maximum = numJobs - done;
+            reserve_jobs (cxt, &reservation);
+        }
+
+        // This handles the case where we might execute the next job right here on the user's thread. These
+        // jobs are not ordered with the ones on the worker threads (see workerSync()), so they're flagged as
+        // such while they run, which lets the commit ticket pass them (but their entries in the job table
+        // aren't reused until they're really done). Jobs with commit functions are the exception, because
+        // their commits must still wait their turn (but that doesn't hold us up here, see finish_job()).
+        // Inside one of our jobs, the job run here gets the worker context of that job, so it sees the same
+        // worker number and uses the same arena (see here_context()).
+
+        if (!reservation.reserved && policy != WaitForAvailableWorkerThread) {
+#ifdef DEBUG
+            currents++;
+#endif
+            set_job_status (cxt, first_job + done, batch->commit ? JobRunning : (WorkerJobStatus) (JobRunning | WORKERS_JOB_UNORDERED));
+            advance_ticket (cxt);
+            set_job_result (cxt, first_job + done, run_job_here (batch, done, here_context (cxt)));
+            finish_job (cxt, first_job + done, batch->commit, batch->commit ? batch->jobs [done].worker_job : NULL);
+
+#ifdef DEBUG
+            if (A_BEFORE_B (first_job + done, last_job))
+                unordered++;
+            else
+                last_job = first_job + done;
+#endif
+            done++;
+            continue;
+        }
+
+        // if we get here then we are going to enqueue jobs, so first potentially wait until there is an available
+        // worker or room in the queue, then put the jobs in the ring and wake up sleeping workers (if there are any)
+
+        if (!reservation.reserved && !wait_until_deadline (cxt, &cxt->workers_ready, NULL, reserve_jobs, &reservation, deadline)) {
+            while (done < numJobs)
+                commit_job (cxt, first_job + done++);
+
+            return 0;
+        }
+
+        ring_push (target, first_job + done, batch, done, reservation.reserved);
+        wake_workers (cxt, target, reservation.reserved);
+#ifdef DEBUG
+        enqueues += reservation.reserved;
+#endif
+        done += reservation.reserved;
+        reservation.reserved = 0;
+    }
+
+    return first_job;
+}
+
+// Enqueue a job that must not start until the specified other jobs (its "prerequisites", given by the
+// job numbers returned when they were enqueued) are all done. This allows work like "sieve a slice, then
+// compress it, then write it" to be expressed as a graph of jobs, with no more ordering than is really
+// needed (unlike workerSync(), which waits for ALL earlier jobs). A job whose prerequisites are not all
+// done yet gets its job number (and its place with a worker thread or in the queue) right away, but it's
+// held aside until they are, so it never ties up a worker thread while it waits, and whichever thread
+// finishes the last prerequisite puts it in the queue. Prerequisites that are done (or are so old that
+// they can't be distinguished from those, or are zero) count as done, so the return value of an enqueue
+// that failed can be passed here safely. Because prerequisites must have been enqueued first, there
+// can't be any cycles.
+//
+// Otherwise the arguments and the policies work just like they do for workersEnqueueJob(), except that
+// when the job is to be run on the caller's thread (for DontUseWorkerThread, or for
+// UseWorkerThreadOnlyIfAvailable when there's no room) then the caller waits for the prerequisites first.
+// The second version copies a payload with the job instead (see workersEnqueueJobCopy()).
+
+static uint32_t enqueue_after (Workers *cxt, const WorkerBatch *batch, const uint32_t *prerequisites,
+    int numPrerequisites, WorkerPolicy policy)
+{
+    WorkerReservation reservation = { 1, 1, 0, 0 };
+    WorkerHeldJob *held = NULL;
+    uint32_t job_number;
+    int i;
+
+    // without worker threads every job is done by the time it's enqueued, so the prerequisites are too
+
+    if (!cxt)
+        return enqueue_batch (cxt, -1, batch, 1, policy, WORKERS_NO_DEADLINE);
+
+    while (numPrerequisites > 0 && !job_pending (cxt, *prerequisites)) {
+        numPrerequisites--;
+        prerequisites++;
+    }
+
+    if (numPrerequisites <= 0)
+        return enqueue_batch (cxt, -1, batch, 1, policy, WORKERS_NO_DEADLINE);
+
+    if (inside_job (cxt)) {                             // see enqueue_batch()
+        reservation.workers_only = 1;
+
+        if (policy == WaitForAvailableWorkerThread)
+            policy = UseWorkerThreadOnlyIfAvailable;
+    }
+
+    if (policy != DontUseWorkerThread && !reserve_jobs (cxt, &reservation)) {
+        if (policy == FailOnNoWorkerThreadAvailable) {
+#ifdef DEBUG
+            failures++;
+#endif
+            return 0;
+        }
+
+        if (policy == WaitForAvailableWorkerThread)
+            wait_until (cxt, &cxt->workers_ready, NULL, reserve_jobs, &reservation);
+    }
+
+    // If we have a place for the job then we hold it, otherwise we're going to run it right here, so we
+    // wait for the prerequisites right here too (which is also what we do if we can't get the memory).
+
+    if (reservation.reserved && !(held = malloc (sizeof (WorkerHeldJob) + numPrerequisites * sizeof (uint32_t)))) {
+        release_jobs (cxt, 1);
+        reservation.reserved = 0;
+    }
+
+    if (!reservation.reserved) {
+        for (i = 0; i < numPrerequisites; ++i)
+            workersWaitOnJob (cxt, prerequisites [i]);
+
+        return enqueue_batch (cxt, -1, batch, 1, policy, WORKERS_NO_DEADLINE);
+    }
+
+    if (!(job_number = next_job_numbers (cxt, 1, policy != FailOnNoWorkerThreadAvailable ? WORKERS_NO_DEADLINE : 0))) {
+        release_jobs (cxt, 1);
+        free (held);
+        return 0;
+    }
+
+    held->node = job_node (cxt, -1);
+    held->job.job_number = job_number;
+    fill_job (&held->job, batch, 0);
+    memcpy (held + 1, prerequisites, numPrerequisites * sizeof (uint32_t));
+    held->waiting_on = prerequisites [0];
+    held->next_prerequisite = 1;
+    held->num_prerequisites = numPrerequisites;
+    hold_job (cxt, held);
+
+    return job_number;
+}
+
+uint32_t workersEnqueueJobAfter (Workers *cxt, int (*workerFunction)(void *, void *), void *workerJob,
+    const uint32_t *prerequisites, int numPrerequisites, WorkerPolicy policy)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+    WorkerJobSpec job;
+
+    job.worker_function = workerFunction;
+    job.worker_job = workerJob;
+    batch.jobs = &job;
+
+    return enqueue_after (cxt, &batch, prerequisites, numPrerequisites, policy);
+}
+
+uint32_t workersEnqueueJobCopyAfter (Workers *cxt, int (*workerFunction)(void *, void *), const void *payload, int payloadSize,
+    const uint32_t *prerequisites, int numPrerequisites, WorkerPolicy policy)
+{
+    WorkerBatch batch = { NULL, NULL, NULL, 0, NULL };
+
+    if (payloadSize < 1 || payloadSize > WORKERS_PAYLOAD_SIZE)
+        return 0;
+
+    batch.function = workerFunction;
+    batch.payloads = payload;
+    batch.payload_size = payloadSize;
+
+    return enqueue_after (cxt, &batch, prerequisites, numPrerequisites, policy);
+}
+
+// Determine whether a specific job number is running, and return TRUE if so. The job number is
+// the non-zero value returned by workersEnqueueJob (). Note that if all the worker functions
+// are calling workerSync(), then a FALSE return from this function would indicate that ALL
+// jobs before the specified one have also completed. Note that this will not apply to a job
+// running on the user's thread, which is running (and so returns TRUE) but doesn't hold up
+// the jobs after it (see enqueue_batch()). A job with a commit function counts as running until
+// that has run too. This is a single lookup in the job table.
+
+int workersIsJobRunning (Workers *cxt, uint32_t jobNumber)
+{
+    return cxt ? job_status (cxt, jobNumber) == JobRunning : 0;
+}
+
+// Return the status of a specific job number (see WorkerJobStatus). Jobs that are run on the
+// user's thread show as "Running" while they run and "Done" afterward, just like the others,
+// but all jobs in the numWorkers == zero / NULL context case show as "Done" (because they are
+// done by the time their job numbers are returned). Job numbers that have not been given out yet
+// (or are so old that they can't be distinguished from those) show as "Unknown".
+
+WorkerJobStatus workersGetJobStatus (Workers *cxt, uint32_t jobNumber)
+{
+    if (!cxt)
+        return jobNumber ? JobDone : JobUnknown;
+
+    return job_status (cxt, jobNumber);
+}
+
+static int job_done (Workers *cxt, void *param)
+{
+    WorkerJobStatus status = job_status (cxt, * (uint32_t *) param);
+
+    return status != JobQueued && status != JobRunning;
+}
+
+// Determine whether a specific job number is running (or waiting in the queue), and if so block
+// until it completes. The job number is the non-zero value returned by workersEnqueueJob(). Note
+// that if all the worker functions are calling workerSync(), then this function would block until
+// ALL jobs before the specified one have also completed. Note that this will not apply to a job
+// running on the user's thread, which is waited for like any other but doesn't hold up the jobs
+// after it. The job's status is looked up in the job table, and the wait is only woken when
+// this particular job completes.
+
+void workersWaitOnJob (Workers *cxt, uint32_t jobNumber)
+{
+    if (cxt)
+        wait_until (cxt, &cxt->job_number, &jobNumber, job_done, &jobNumber);
+}
+
+// These are the same as workersWaitOnJob() and workersWaitAllJobs() except that they only wait until the
+// specified deadline, and return TRUE if the job (or all the jobs) completed and FALSE if the deadline
+// passed first. The deadline is in nanoseconds on the same monotonic clock as workersGetTime(), so a
+// timeout is simply added to the current time (and a deadline that has already passed just checks).
+// The sleeping thread is woken for the deadline by the operating system (with a futex or a condition
+// variable timeout) so it doesn't have to be woken by anybody else.
+
+int workersWaitOnJobUntil (Workers *cxt, uint32_t jobNumber, uint64_t deadline)
+{
+    return cxt ? wait_until_deadline (cxt, &cxt->job_number, &jobNumber, job_done, &jobNumber, deadline) : 1;
+}
+
+int workersWaitAllJobsUntil (Workers *cxt, uint64_t deadline)
+{
+    return cxt ? wait_until_deadline (cxt, &cxt->jobs_pending, NULL, all_jobs_done, NULL, deadline) : 1;
+}
+
+// Return the current time, in nanoseconds, of the monotonic clock that the deadlines are based on (see
+// workersWaitOnJobUntil()). This has no particular starting point, and is not affected by changes to
+// the system's time of day.
+
+uint64_t workersGetTime (void)
+{
+    return get_time ();
+}
+
+// Get the value returned by the worker function of a specific job. The job number is the non-zero value
+// returned by workersEnqueueJob() (or one of the others) and the return value of every job is kept, so this
+// can be called for any job without any extra synchronization in the worker functions (i.e., the job
+// numbers act as "futures"). The first version blocks until the job is done (like workersWaitOnJob()) and
+// the second version never blocks. Both return TRUE and store the result if the job is done, otherwise
+// FALSE is returned (because the job is not done yet, for the second version, or because the result is
+// no longer available). The results are kept until WORKERS_JOB_TABLE_SIZE (65536) more job numbers have
+// been given out, which is at least until that many more jobs have been enqueued. Results are not kept in
+// the numWorkers == zero / NULL context case (because the jobs don't really have job numbers).
+
+typedef struct {
+    uint32_t job_number;        // the job whose result is wanted
+    int available;              // set if the result was retrieved
+    int result;                 // the result (if available)
+} WorkerResultQuery;
+
+static int result_ready (Workers *cxt, void *param)
+{
+    WorkerResultQuery *query = param;
+    uint64_t entry = wkr_atomic_load64 (cxt->job_results [query->job_number & (WORKERS_JOB_TABLE_SIZE - 1)]);
+
+    if ((uint32_t) (entry >> 32) == query->job_number) {
+        query->result = (int) (uint32_t) entry;
+        return query->available = 1;
+    }
+
+    // if the entry has been reused (or the job number has never been given out, or the job was dropped
+    // because it was cancelled) then it's not coming
+
+    return A_AFTER_B ((uint32_t) (entry >> 32), query->job_number) || job_status (cxt, query->job_number) == JobUnknown ||
+        (job_cancelled (cxt, query->job_number) && !job_pending (cxt, query->job_number));
+}
+
+int workersGetJobResult (Workers *cxt, uint32_t jobNumber, int *result)
+{
+    WorkerResultQuery query = { 0, 0, 0 };
+
+    if (!cxt || !jobNumber)
+        return 0;
+
+    query.job_number = jobNumber;
+
+    if (!result_ready (cxt, &query))
+        wait_until (cxt, &cxt->job_number, &query.job_number, result_ready, &query);
+
+    if (query.available)
+        *result = query.result;
+
+    return query.available;
+}
+
+int workersTryGetJobResult (Workers *cxt, uint32_t jobNumber, int *result)
+{
+    WorkerResultQuery query = { 0, 0, 0 };
+
+    if (!cxt || !jobNumber)
+        return 0;
+
+    query.job_number = jobNumber;
+
+    if (result_ready (cxt, &query) && query.available)
+        *result = query.result;
+
+    return query.available;
+}
+
+// Cancel a specific job (the job number is the non-zero value returned by workersEnqueueJob(), or one of
+// the others) or a group of jobs with consecutive job numbers (like the ones enqueued together by
+// workersEnqueueJobs()) or every job that's not done yet (for example, to abort a long computation before
+// calling workersDeinit()). Jobs that haven't started yet are dropped when they come up, without their
+// worker functions ever being called (so anything those would have freed must be freed by the caller),
+// and jobs that are running are expected to notice that they have been cancelled (see workerCancelled())
+// and return early. Either way, a cancelled job is done as usual (so the jobs waiting for it are not held
+// up) but a job that was dropped has no result (see workersGetJobResult()). Only jobs that are queued or
+// running can be cancelled, so jobs that ran on the user's thread (which are already done by the time
+// anybody knows their job numbers) can't be. These return the number of jobs cancelled (not counting
+// any that were cancelled already), and nothing can be cancelled in the numWorkers == zero / NULL
+// context case.
+
+int workersCancelJobs (Workers *cxt, uint32_t firstJob, int numJobs)
+{
+    int cancelled = 0, i;
+
+    if (cxt)
+        for (i = 0; i < numJobs; ++i)
+            if (job_pending (cxt, firstJob + i) && cancel_job (cxt, firstJob + i))
+                cancelled++;
+
+    return cancelled;
+}
+
+int workersCancelJob (Workers *cxt, uint32_t jobNumber)
+{
+    return workersCancelJobs (cxt, jobNumber, 1);
+}
+
+// Every job that's not done yet has its own entry in the job table, so to cancel them all we look at
+// the entries rather than at every job number from the commit ticket on (because one long job can
+// hold up the ticket while the number of jobs given out since then grows far past the size of the
+// table), unless there are fewer of those than entries. Only jobs given out before we start are
+// cancelled, not ones that are enqueued meanwhile.
+
+int workersCancelAllJobs (Workers *cxt)
+{
+    uint32_t ticket, end, job_number, status;
+    int cancelled = 0, i;
+    uint64_t entry;
+
+    if (!cxt)
+        return 0;
+
+    ticket = wkr_atomic_load (cxt->commit_ticket);
+    end = wkr_atomic_load (cxt->job_number);
+
+    if (end - ticket <= WORKERS_JOB_TABLE_SIZE)
+        return workersCancelJobs (cxt, ticket, (int) (end - ticket));
+
+    for (i = 0; i < WORKERS_JOB_TABLE_SIZE; ++i) {
+        entry = wkr_atomic_load64 (cxt->job_table [i]);
+        job_number = (uint32_t) (entry >> 32);
+        status = (uint32_t) entry & 0xff;
+
+        if ((status == JobQueued || status == JobRunning) && job_number - ticket < end - ticket &&
+            cancel_job (cxt, job_number))
+                cancelled++;
+    }
+
+    return cancelled;
+}
+
+// Block until all jobs have completed (including any waiting in the queue), not counting any
+// job(s) running on the user's thread. While there are jobs waiting in the queue, the calling
+// thread runs them itself (see workersEnqueueJob()).
+
+void workersWaitAllJobs (Workers *cxt)
+{
+    if (cxt)
+        wait_until (cxt, &cxt->jobs_pending, NULL, all_jobs_done, NULL);
+}
+
+// Return the number of jobs currently running on worker threads. This does not include any job(s)
+// running on the user's thread(s).
+
+int workersNumRunningJobs (Workers *cxt)
+{
+    return cxt ? cxt->num_workers - wkr_atomic_load (cxt->workers_ready) : 0;
+}
+
+// Return the number of jobs currently waiting in the queue for a worker thread to become available.
+
+int workersNumQueuedJobs (Workers *cxt)
+{
+    int retval = 0, count, i;
+
+    if (cxt)
+        for (i = 0; i < cxt->num_nodes; ++i) {
+            count = (int) (wkr_atomic_load (cxt->nodes [i].enqueue_pos) - wkr_atomic_load (cxt->nodes [i].dequeue_pos));
+
+            if (count > 0)      // the two positions can be momentarily inconsistent
+                retval += count;
+        }
+
+    return retval;
+}
+
+// Return the statistics for the spin-then-park waiting (see the WorkersStats structure). These
+// are all zero for the numWorkers == zero / NULL context case because nothing ever waits.
+
+void workersGetStats (Workers *cxt, WorkersStats *stats)
+{
+    memset (stats, 0, sizeof (WorkersStats));
+
+    if (cxt) {
+        stats->worker_spins = wkr_atomic_load64 (cxt->idle_stats.spins);
+        stats->worker_parks = wkr_atomic_load64 (cxt->idle_stats.parks);
+        stats->worker_wait_time = wkr_atomic_load (cxt->idle_stats.wait_time);
+        stats->waiter_spins = wkr_atomic_load64 (cxt->wait_stats.spins);
+        stats->waiter_parks = wkr_atomic_load64 (cxt->wait_stats.parks);
+        stats->waiter_wait_time = wkr_atomic_load (cxt->wait_stats.wait_time);
+    }
+}
+
+// Return the placement of the worker threads that was chosen by the affinity policy (see workersInitConfig()).
+// The processor that each worker thread is pinned to is stored in the cpus array (in worker thread order,
+// up to maxCpus of them) with -1 for threads that are not pinned to a single processor (because there's no
+// policy, or it's InheritAffinity, or the pinning failed). The number of worker threads is returned.
+
+int workersGetPlacement (Workers *cxt, int *cpus, int maxCpus)
+{
+    int i;
+
+    if (!cxt)
+        return 0;
+
+    for (i = 0; i < cxt->num_workers && i < maxCpus; ++i)
+        cpus [i] = cxt->workers [i].cpu;
+
+    return cxt->num_workers;
+}
+
+// Return the statistics for each node (see the WorkersNodeStats structure) in the stats array (up to
+// maxNodes of them, in ascending order of node number), so that the NUMA awareness can be checked. The
+// number of nodes is returned, which is one if there's no NUMA awareness (or only one node), and zero
+// in the numWorkers == zero / NULL context case.
+
+int workersGetNodeStats (Workers *cxt, WorkersNodeStats *stats, int maxNodes)
+{
+    int i;
+
+    if (!cxt)
+        return 0;
+
+    for (i = 0; i < cxt->num_nodes && i < maxNodes; ++i) {
+        memset (stats + i, 0, sizeof (WorkersNodeStats));
+        stats [i].node_id = cxt->nodes [i].node_id;
+        stats [i].num_workers = cxt->nodes [i].num_workers;
+    }
+
+    for (i = 0; i < cxt->num_workers; ++i) {
+        int node = (int) (cxt->workers [i].node - cxt->nodes);
+
+        if (node < maxNodes) {
+            stats [node].local_jobs += wkr_atomic_load64 (cxt->workers [i].local_jobs);
+            stats [node].remote_jobs += wkr_atomic_load64 (cxt->workers [i].remote_jobs);
+        }
+    }
+
+    return cxt->num_nodes;
+}
+
+// Return the number of worker threads currently available to accept jobs and do work.
+
+int workersNumAvailableWorkers (Workers *cxt)
+{
+    return cxt ? wkr_atomic_load (cxt->workers_ready) : 0;
+}
+
+// Destroy the specified instance of the workers thread manager. This includes spinning down the
+// worker threads and freeing all resources consumed by the manager. It's probably a good idea
+// to not do this until all the workers are in the "Ready" state (by, for example, calling 
+// workersWaitAllJobs()), but this would normally be the case in well-designed application.
+// Any jobs still waiting in the queue are run to completion first (because they presumably
+// own resources that the worker functions would free), so to abort them instead (and the
+// running ones, if they check) call workersCancelAllJobs() first. After calling this function,
+// the context pointer should not be reused.
+
+void workersDeinit (Workers *cxt)
+{
+    if (cxt) {
+        int i;
+
+        workersWaitAllJobs (cxt);
+
+#ifdef DEBUG
+        printf ("total jobs = %u, failures = %u, enqueues = %u, currents = %u, unordered = %u\n",
+            cxt->job_number - 1, failures, enqueues, currents, unordered);
+        printf ("worker spins = %llu, worker parks = %llu, waiter spins = %llu, waiter parks = %llu\n",
+            (unsigned long long) cxt->idle_stats.spins, (unsigned long long) cxt->idle_stats.parks,
+            (unsigned long long) cxt->wait_stats.spins, (unsigned long long) cxt->wait_stats.parks);
+#endif
+
+        wkr_atomic_store (cxt->quit, 1);
+        wake_workers (cxt, NULL, cxt->num_workers);
+
+        for (i = 0; i < cxt->num_workers; ++i) {
+            wkr_thread_join (cxt->workers [i].thread);
+            wkr_thread_delete (cxt->workers [i].thread);
+            aligned_free (cxt->workers [i].deque.jobs);
+#ifndef WORKERS_FUTEX
+            wkr_condvar_delete (cxt->workers [i].condvar);
+#endif
+        }
+
+        aligned_free (cxt->workers);
+        cxt->workers = NULL;
+        free_nodes (cxt);
+        aligned_free (cxt->job_table);
+        cxt->job_table = NULL;
+        aligned_free (cxt->skip_table);
+        cxt->skip_table = NULL;
+        aligned_free (cxt->job_results);
+        cxt->job_results = NULL;
+        aligned_free (cxt->cancel_table);
+        cxt->cancel_table = NULL;
+        aligned_free (cxt->commit_table);
+        cxt->commit_table = NULL;
+        wkr_mutex_delete (cxt->mutex);
+        aligned_free (cxt);
+    }
+}
+
+// This is the context for a single call to workersParallelFor(). It's shared by the calling thread
+// and the "helper" jobs that run on the worker threads, and it's freed by whoever is the last to
+// let go of it (because helper jobs that start late might still be holding it after the loop is
+// done and the caller has returned). The fields that are written while the loop runs are kept in a
+// separate cache line from the ones that every thread reads for every chunk.
+
+typedef struct {
+    Workers *workers;               // the worker thread manager running the loop (never NULL)
+    int (*function)(void *, int64_t, int64_t, void *); // the user-supplied function to run the chunks
+    void *arg;                      // the user-supplied argument for the function
+    int64_t end;                    // end of the range
+    int64_t chunk_size;             // fixed chunk size (or minimum chunk size for GuidedChunks)
+    WorkerChunking chunking;        // how the range is divided into chunks
+    int participants;               // maximum number of threads participating (for GuidedChunks)
+
+    wkr_cache_aligned
+    int64_t next;                   // next iteration to hand out
+    int active;                     // number of threads currently looking for (or running) chunks
+    int result;                     // the first non-zero value returned by the function (which stops the loop)
+    int references;                 // number of threads (and enqueued helper jobs) holding this context
+} WorkerLoop;
+
+// Get the next chunk of the loop range, returning FALSE if the range has been used up (or stopped).
+// The next iteration is only ever advanced up to the end of the range (with a CAS rather than just
+// adding the chunk size) so that it can't overflow when the range ends near INT64_MAX.
+
+static int next_loop_chunk (WorkerLoop *loop, int64_t *begin, int64_t *end)
+{
+    int64_t next, size;
+
+    if (wkr_atomic_load (loop->result))
+        return 0;
+
+    for (next = wkr_atomic_load64 (loop->next); next < loop->end; next = wkr_atomic_load64 (loop->next)) {
+        size = loop->chunking == GuidedChunks ? (loop->end - next) / (loop->participants * 2) : 0;
+
+        if (size < loop->chunk_size)
+            size = loop->chunk_size;
+
+        if (size > loop->end - next)
+            size = loop->end - next;
+
+        if (wkr_atomic_cas64 (loop->next, next, next + size)) {
+            *begin = next;
+            *end = next + size;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Run chunks of the loop until there are no more. The "active" count is incremented before we start
+// looking for chunks, so once the caller has seen the range used up and the count go to zero, every
+// chunk has been completed.
+
+static void run_loop_chunks (WorkerLoop *loop, void *worker)
+{
+    WorkerArena *arena = context_arena (worker);
+    size_t used = arena->used;
+    void *overflow = arena->overflow;
+    int64_t begin, end;
+    int result;
+
+    wkr_atomic_add (loop->active, 1);
+
+    // any scratch memory that a chunk gets from the arena is taken back after the chunk
+
+    while (next_loop_chunk (loop, &begin, &end)) {
+        if ((result = loop->function (loop->arg, begin, end, worker)))
+            wkr_atomic_cas (loop->result, 0, result);
+
+        arena_release (arena, used, overflow);
+    }
+
+    if (!wkr_atomic_add (loop->active, -1))
+        wake_waiters (loop->workers, loop, 0, INT32_MAX);
+}
+
+static void release_loop (WorkerLoop *loop)
+{
+    if (!wkr_atomic_add (loop->references, -1))
+        aligned_free (loop);
+}
+
+static int loop_helper (void *param, void *worker)
+{
+    run_loop_chunks (param, worker);
+    release_loop (param);
+    return 0;
+}
+
+static int loop_done (Workers *cxt, void *param)
+{
+    WorkerLoop *loop = param;
+
+    (void) cxt;
+    return !wkr_atomic_load (loop->active);
+}
+
+// Run a "parallel for" loop over the range [begin, end), with the range automatically divided into
+// chunks that are handed out to the worker threads AND the calling thread (which participates fully
+// and only returns once every iteration is done). This replaces the common pattern of a loop that
+// allocates a small structure for each iteration and enqueues it, and also balances the load when
+// the iterations have uneven costs. The arguments are:
+//
+// cxt:             Context pointer returned by workersInit() (NULL is fine, in which case the whole
+//                  range is done in a single call on the current thread)
+//
+// begin, end:      The range of iterations to perform (begin inclusive, end exclusive)
+//
+// loopFunction:    Pointer to the function that will be called to do each chunk. The arguments are
+//                  the loopArg pointer, the range of the chunk (again, begin inclusive and end
+//                  exclusive) and the same opaque worker pointer that's passed to a worker function.
+//                  Note that workerSync() should NOT be used with this pointer because the chunks
+//                  are not associated with job numbers. The function should normally return zero,
+//                  and returning anything else stops the loop early (no more chunks are started).
+//
+// loopArg:         User-defined pointer passed to the loop function
+//
+// chunking:        StaticChunks divides the range into equal chunks of the specified size, or by
+//                  default (chunkSize zero) into one chunk for each participating thread. This has
+//                  the lowest overhead but doesn't balance uneven loads. DynamicChunks hands out
+//                  chunks of the specified size (by default a single iteration) as the threads
+//                  become free. GuidedChunks hands out chunks that are a share of what's left of the
+//                  range, so they start large and get smaller, down to the specified minimum size
+//                  (default one), which balances the load with far fewer chunks than DynamicChunks.
+//
+// returns:         Zero if every iteration was performed, otherwise the first non-zero value returned
+//                  by the loop function.
+//
+// Helper jobs are only enqueued for worker threads that are available (i.e., this never blocks waiting
+// for a worker), so this works fine when called from inside a worker function, or when the workers are
+// busy with other jobs (in which case the calling thread simply does more of the work itself).
+
+int workersParallelFor (Workers *cxt, int64_t begin, int64_t end, int (*loopFunction)(void*,int64_t,int64_t,void*),
+    void *loopArg, WorkerChunking chunking, int64_t chunkSize)
+{
+    int result, helpers, i;
+    WorkerLoop *loop;
+
+    if (begin >= end)
+        return 0;
+
+    if (!cxt) {
+        size_t used = caller_arena.used;
+        void *overflow = caller_arena.overflow;
+
+        result = loopFunction (loopArg, begin, end, cxt);
+        arena_release (&caller_arena, used, overflow);
+        return result;
+    }
+
+    loop = aligned_calloc (1, sizeof (WorkerLoop));
+    loop->workers = cxt;
+    loop->function = loopFunction;
+    loop->arg = loopArg;
+    loop->next = begin;
+    loop->end = end;
+    loop->chunking = chunking;
+    loop->participants = cxt->num_workers + 1;
+    loop->references = 1;
+
+    if (chunkSize > 0)
+        loop->chunk_size = chunkSize;
+    else if (chunking == StaticChunks)
+        loop->chunk_size = (end - begin + loop->participants - 1) / loop->participants;
+    else
+        loop->chunk_size = 1;
+
+    // enqueue helper jobs for as many worker threads as are available (but no more than could get chunks,
+    // counting the one that the calling thread will get), and then do our share
+
+    helpers = cxt->num_workers;
+
+    if (chunking != GuidedChunks && (end - begin - 1) / loop->chunk_size < helpers)
+        helpers = (int) ((end - begin - 1) / loop->chunk_size);
+
+    for (i = 0; i < helpers; ++i) {
+        wkr_atomic_add (loop->references, 1);
+
+        if (!workersEnqueueJob (cxt, loop_helper, loop, FailOnNoWorkerThreadAvailable)) {
+            wkr_atomic_add (loop->references, -1);
+            break;
+        }
+    }
+
+    run_loop_chunks (loop, here_context (cxt));
+    wait_until (cxt, loop, NULL, loop_done, loop);
+    result = wkr_atomic_load (loop->result);
+    release_loop (loop);
+
+    return result;
+}
+
+// Jobs enqueued in a group (see below) are run by this function, which gets the group along with the
+// user's worker function and job pointer in its payload. It drops the job if the group has been
+// cancelled, and counts it out of the group when it returns (waking anything waiting for the group if
+// it was the last). Nothing in the group can be touched after that, because it might be gone.
+
+typedef struct {
+    WorkerGroup *group;             // the group the job belongs to
+    int (*function)(void*,void*);   // the user-supplied function to actually perform the work
+    void *job;                      // the user-supplied (and -defined) pointer to the work "data"
+} WorkerGroupJob;
+
+static void leave_group (WorkerGroup *group)
+{
+    Workers *cxt = group->workers;
+
+    if (!wkr_atomic_add (group->num_jobs, -1) && cxt)
+        wake_waiters (cxt, group, 0, INT32_MAX);
+}
+
+static int group_job (void *param, void *context)
+{
+    WorkerGroupJob *job = param;
+    WorkerGroup *previous = current_group;
+    int result = 0;
+
+    if (!wkr_atomic_load (job->group->cancelled)) {
+        current_group = job->group;
+        result = job->function (job->job, context);
+        current_group = previous;
+    }
+
+    leave_group (job->group);
+    return result;
+}
+
+static int group_done (Workers *cxt, void *param)
+{
+    WorkerGroup *group = param;
+
+    (void) cxt;
+    return !wkr_atomic_load (group->num_jobs);
+}
+
+// Task groups allow sets of jobs that have nothing to do with each other (like batches enqueued from
+// different parts of a program) to be waited on separately, rather than with workersWaitAllJobs() which
+// waits for every job (so one slow batch would hold up the others). The group is just a counter of the
+// jobs enqueued in it that have not returned yet, so waiting for it, counting it or cancelling it never
+// has to look at the worker threads or the queue. The functions are:
+//
+// workersGroupInit():        Set up the group (which belongs to the caller) for enqueuing jobs on the
+//                            specified context (which may be NULL, in which case the jobs simply run
+//                            when they're enqueued). A group can be reused once its jobs are done.
+//
+// workersGroupEnqueueJob():  Enqueue a job in the group, exactly like workersEnqueueJob() (including
+//                            the policy, and returning the job number) except that the job counts in
+//                            the group until it returns. Jobs can be added to a group at any time, even
+//                            from inside the group's own jobs.
+//
+// workersGroupNumJobs():     Return the number of the group's jobs that have not returned yet.
+//
+// workersGroupWait():        Block until all the group's jobs have returned (and while they haven't,
+//                            run queued jobs, just like workersWaitAllJobs() does). workersGroupWaitUntil()
+//                            gives up at the specified deadline (see workersGetTime()), returning FALSE
+//                            if the jobs still haven't returned.
+//
+// workersGroupCancel():      Cancel the group. Its jobs that haven't started yet are dropped when they
+//                            come up (returning zero as their result), and its running jobs see that
+//                            they've been cancelled with workerCancelled(). Returns the number of the
+//                            group's jobs that had not returned yet. The group stays cancelled (so jobs
+//                            enqueued in it later are dropped too) until it's initialized again.
+
+void workersGroupInit (WorkerGroup *group, Workers *cxt)
+{
+    group->workers = cxt;
+    group->num_jobs = 0;
+    group->cancelled = 0;
+}
+
+uint32_t workersGroupEnqueueJob (WorkerGroup *group, int (*workerFunction)(void*,void*), void *WorkerJob, WorkerPolicy policy)
+{
+    WorkerGroupJob job = { group, workerFunction, WorkerJob };
+    uint32_t job_number;
+
+    // the job is counted before it's enqueued (because it could be done right away) and counted back
+    // out if it wasn't enqueued after all
+
+    wkr_atomic_add (group->num_jobs, 1);
+
+    if (!(job_number = workersEnqueueJobCopy (group->workers, group_job, &job, sizeof (job), policy)))
+        leave_group (group);
+
+    return job_number;
+}
+
+int workersGroupNumJobs (WorkerGroup *group)
+{
+    return wkr_atomic_load (group->num_jobs);
+}
+
+void workersGroupWait (WorkerGroup *group)
+{
+    if (group->workers)
+        wait_until (group->workers, group, NULL, group_done, group);
+}
+
+int workersGroupWaitUntil (WorkerGroup *group, uint64_t deadline)
+{
+    return group->workers ? wait_until_deadline (group->workers, group, NULL, group_done, group, deadline) : 1;
+}
+
+int workersGroupCancel (WorkerGroup *group)
+{
+    wkr_atomic_store (group->cancelled, 1);
+    return wkr_atomic_load (group->num_jobs);
+}
+
+// This is a token of a pipeline (see workersPipeline() below). There's a fixed number of them, and
+// each item produced by the input stage needs one until it has gone through all the stages, so they
+// cap the number of items in the pipeline at once (and so the memory they use).
+
+typedef struct {
+    void *item;                     // the item that the token carries (NULL if a stage has dropped it)
+    int64_t sequence;               // the order in which the input stage produced the item
+    int stage;                      // index of the next stage that the item goes through
+} WorkerToken;
+
+// This is the state of each stage of a pipeline. Serial stages have a buffer (with room for every token)
+// where items wait for the stage to be free (or for their turn, in the case of SerialInOrderStage).
+
+typedef struct {
+    void *(*function)(void *, void *, void *); // the user-supplied function to process an item in this stage
+    WorkerStageMode mode;           // how the stage handles items
+    int busy;                       // set while a serial stage is processing an item
+    int num_waiting;                // number of tokens waiting for a serial stage
+    int64_t next_sequence;          // sequence number of the next item for a SerialInOrderStage
+    WorkerToken **waiting;          // the tokens waiting for a serial stage
+} WorkerPipeStage;
+
+// This is the context for a single call to workersPipeline(). Like the context for workersParallelFor()
+// it's shared by the calling thread and the "helper" jobs running on the worker threads, and it's freed
+// by whoever is the last to let go of it. Moving tokens between the stages is done with the pipeline's
+// own mutex held (but never the stage functions themselves), and what the waiting caller and the helpers
+// need to know without taking it is copied into a separate cache line.
+
+typedef struct {
+    Workers *workers;               // the worker thread manager running the pipeline (never NULL)
+    void *arg;                      // the user-supplied argument for the stage functions
+    WorkerPipeStage *stages;        // the stages (the first one is the input stage)
+    int num_stages;                 // number of stages
+    WorkerToken *tokens;            // the tokens
+    int num_tokens;                 // number of tokens
+    int max_helpers;                // most helper jobs to have at once (one for each worker thread)
+    wkr_mutex_t mutex;              // protects everything below (up to the next cache line)
+
+    WorkerToken **free_tokens;      // the tokens that are not carrying items (the input stage takes these)
+    int num_free;                   // number of free tokens
+    WorkerToken **ready_tokens;     // the tokens that were waiting for a serial stage that's now free for them
+    int num_ready;                  // number of ready tokens
+    int input_busy;                 // set while the input stage is producing an item
+    int input_done;                 // set once the input stage has produced its last item
+    int64_t num_items;              // number of items produced by the input stage so far
+
+    wkr_cache_aligned
+    int work;                       // number of things for a thread to do (ready tokens, plus one if an item can be input)
+    int finished;                   // set once the last item has been input and all the tokens are free again
+    int helpers;                    // number of helper jobs enqueued (or running) that haven't run out of work yet
+    int references;                 // number of threads (and enqueued helper jobs) holding this context
+} WorkerPipeline;
+
+static int pipeline_helper (void *param, void *worker);
+
+// Update the fields that are read without the mutex, which must be held (and return the amount of work).
+
+static int update_pipeline (WorkerPipeline *pipeline)
+{
+    int work = pipeline->num_ready + (!pipeline->input_busy && !pipeline->input_done && pipeline->num_free);
 
-    while (1) {
-        wkr_mutex_obtain (global->mutex);
-        thread->state = Ready;
-        global->workers_ready++;
-        wkr_condvar_signal (global->condvar);       // signal that we're ready to work
+    wkr_atomic_store (pipeline->work, work);
+
+    if (pipeline->input_done && pipeline->num_free == pipeline->num_tokens)
+        wkr_atomic_store (pipeline->finished, 1);
+
+    return work;
+}
 
-        while (thread->state == Ready)              // wait for something to do
-            wkr_condvar_wait (thread->condvar, global->mutex);
+// Let the threads know that there's work for them (or that the pipeline is finished), which means waking
+// the calling thread if it's waiting and, so that all the worker threads can help, enqueuing helper jobs
+// for the work (as long as there are worker threads available for them, so this never blocks).
 
-        wkr_mutex_release (global->mutex);
+static void wake_pipeline (WorkerPipeline *pipeline, int work)
+{
+    wake_waiters (pipeline->workers, pipeline, 0, INT32_MAX);
 
-        if (thread->state == Quit)                  // break out if we're done, otherwise work...
+    while (work-- > 0) {
+        if (wkr_atomic_add (pipeline->helpers, 1) > pipeline->max_helpers) {
+            wkr_atomic_add (pipeline->helpers, -1);
             break;
+        }
 
-        thread->worker_function (thread->worker_job, thread);
+        wkr_atomic_add (pipeline->references, 1);
 
-#ifdef DEBUG
-        if (A_BEFORE_B (thread->job_number, last_job))
-            unordered++;
-        else
-            last_job = thread->job_number;
-#endif
+        if (!workersEnqueueJob (pipeline->workers, pipeline_helper, pipeline, FailOnNoWorkerThreadAvailable)) {
+            wkr_atomic_add (pipeline->references, -1);
+            wkr_atomic_add (pipeline->helpers, -1);
+            break;
+        }
     }
-
-    wkr_thread_exit (0);
-    return 0;
 }
 
-// This function is only called from within the user-provided function that performs the
-// work. After this function is called (using the second void pointer passed into the
-// work function) it is guaranteed that all previously enqueued jobs have run to
-// completion and that the rest of the code in the job will run single-threaded (i.e.,
-// no future job will be allowed into this section until after this job has run to
-// completion). This is provided for applications that require that the results of the
-// work be handled in the order that the jobs are enqueued, including things like
-// race-free updating of global variables or writing the results to a file.
+// Take the next token for the current thread to run, if there is one, with the mutex held. Tokens that
+// are ready to continue come first (so items in the pipeline are finished before more are started) and
+// otherwise, if the input stage is free and there's a free token, that's taken to input a new item.
 
-void workerSync (void *context)
+static WorkerToken *next_token (WorkerPipeline *pipeline)
 {
-    Workers *global = context;
-    
-    // First we handle the case where this was actually running on a worker thread. For
-    // that case we must wait until all previous jobs are completed. However later jobs
-    // and a job running on the user's thread can continue.
+    WorkerToken *token;
+
+    if (pipeline->num_ready)
+        token = pipeline->ready_tokens [--pipeline->num_ready];
+    else if (!pipeline->input_busy && !pipeline->input_done && pipeline->num_free) {
+        token = pipeline->free_tokens [--pipeline->num_free];
+        token->item = NULL;
+        token->stage = 0;
+        pipeline->input_busy = 1;
+    }
+    else
+        return NULL;
 
-    if (global && global->worker_number) {
-        WorkerInfo *info = context;
-        int i;
+    update_pipeline (pipeline);
+    return token;
+}
 
-        global = info->workers;
-        wkr_mutex_obtain (global->mutex);
+// Run a token through the stages, for as far as it can go. Parallel stages are simply run, but a serial
+// stage that's busy (or, in the case of SerialInOrderStage, waiting for an earlier item) leaves the token
+// in its buffer, and whichever thread finishes with the stage makes the next one that can go ready again.
+// Items dropped by a stage still go through the remaining SerialInOrderStage stages (without the stage
+// function being called) so that the stages' sequence numbers aren't held up waiting for them. Any scratch
+// memory that a stage function gets from the arena is taken back after it returns.
 
-        for (i = 0; i < global->num_workers; ++i)
-            while (global->workers [i].state == Running && A_BEFORE_B (global->workers [i].job_number, info->job_number))
-                wkr_condvar_wait (global->condvar, global->mutex);
+static void run_token (WorkerPipeline *pipeline, WorkerToken *token, void *worker)
+{
+    WorkerArena *arena = context_arena (worker);
+    size_t used = arena->used;
+    void *overflow = arena->overflow;
+    WorkerPipeStage *stage;
+    int serial, work, i;
+
+    for (; token->stage < pipeline->num_stages; token->stage++) {
+        stage = pipeline->stages + token->stage;
+        serial = token->stage && stage->mode != ParallelStage && (token->item || stage->mode == SerialInOrderStage);
+
+        if (serial) {
+            wkr_mutex_obtain (pipeline->mutex);
+
+            if (stage->busy || (stage->mode == SerialInOrderStage && token->sequence != stage->next_sequence)) {
+                stage->waiting [stage->num_waiting++] = token;
+                wkr_mutex_release (pipeline->mutex);
+                return;
+            }
 
-        wkr_mutex_release (global->mutex);
-    }
+            stage->busy = 1;
+            wkr_mutex_release (pipeline->mutex);
+        }
 
-    // The second case is where this is running on the user's thread, not on a worker thread.
-    // For this case we must wait until ALL worker threads are completed.
+        if (token->item || !token->stage) {
+            token->item = stage->function (token->item, pipeline->arg, worker);
+            arena_release (arena, used, overflow);
+        }
 
-    else if (global) {
-        wkr_mutex_obtain (global->mutex);
+        // the input stage is taken by next_token(), and when it's done the token either has a new item
+        // (which gets the next sequence number) or it's the end of the input, and the token is freed
 
-        while (global->workers_ready < global->num_workers)
-            wkr_condvar_wait (global->condvar, global->mutex);
+        if (!token->stage) {
+            wkr_mutex_obtain (pipeline->mutex);
+            pipeline->input_busy = 0;
 
-        wkr_mutex_release (global->mutex);
-    }
+            if (token->item)
+                token->sequence = pipeline->num_items++;
+            else {
+                pipeline->input_done = 1;
+                pipeline->free_tokens [pipeline->num_free++] = token;
+            }
 
-    // A final case is also handled where this is running without any worker threads at all,
-    // indicated by the passed pointer being NULL. Obviously there's nothing to do then.
-}
+            work = update_pipeline (pipeline);
+            wkr_mutex_release (pipeline->mutex);
+            wake_pipeline (pipeline, work);
 
-// Initialize the worker thread manager and spin up all the workers. There is no limit here
-// imposed on the number of workers, but the underlying operating system and the machine's
-// resources may certainly impose limits. Note that there is no issue creating more workers
-// than the machine has cores, although the number of machine cores (or hyperthreads) is
-// obviously a good starting point for experimentation.
-//
-// It is also possible to call this function specifying zero threads, which basically does
-// nothing except return a NULL pointer. Interestingly though, this is valid and the rest
-// of the manager's functionality is still perfectly usable and all requested jobs will
-// simply be completed on the user's calling thread (which will block until the job is
-// done). This is different from the case of specifying a single worker thread, which
-// allows single jobs to run in the background while the user's thread immediately
-// returns to the user.
+            if (!token->item)
+                return;
+        }
+        else if (serial) {
+            wkr_mutex_obtain (pipeline->mutex);
+            stage->busy = 0;
 
-Workers *workersInit (int numWorkerThreads)
-{
-    Workers *cxt;
-    int i;
+            if (stage->mode == SerialInOrderStage)
+                stage->next_sequence++;
 
-    if (!numWorkerThreads)  // if no worker threads, just return NULL pointer
-        return NULL;        // (this is a valid use case and still works)
+            for (i = 0; i < stage->num_waiting; ++i)
+                if (stage->mode != SerialInOrderStage || stage->waiting [i]->sequence == stage->next_sequence) {
+                    pipeline->ready_tokens [pipeline->num_ready++] = stage->waiting [i];
+                    stage->waiting [i] = stage->waiting [--stage->num_waiting];
+                    break;
+                }
 
-    // initialize the main structure of the worker manager
+            work = update_pipeline (pipeline);
+            wkr_mutex_release (pipeline->mutex);
 
-    cxt = calloc (1, sizeof (Workers));
-    cxt->workers = calloc (cxt->num_workers = numWorkerThreads, sizeof (WorkerInfo));
-    wkr_condvar_init (cxt->condvar);
-    wkr_mutex_init (cxt->mutex);
+            if (work)
+                wake_pipeline (pipeline, work);
+        }
+    }
 
-    // initialize and start each worker thread
+    wkr_mutex_obtain (pipeline->mutex);
+    pipeline->free_tokens [pipeline->num_free++] = token;
+    work = update_pipeline (pipeline);
+    wkr_mutex_release (pipeline->mutex);
+    wake_pipeline (pipeline, work);
+}
 
-    for (i = 0; i < numWorkerThreads; ++i) {
-        cxt->workers [i].workers = cxt;
-        cxt->workers [i].worker_number = i + 1;
-        wkr_condvar_init (cxt->workers [i].condvar);
-        wkr_thread_create (cxt->workers [i].thread, worker_thread, &cxt->workers [i]);
+// Run tokens until there are none for this thread to run. A helper job counts itself out of the helpers
+// with the mutex held, so that any work added after it has given up sees that it needs another helper.
 
-        // gracefully handle failures in creating worker threads
+static void run_tokens (WorkerPipeline *pipeline, void *worker, int helper)
+{
+    WorkerToken *token;
 
-        if (!cxt->workers [i].thread) {
-            wkr_condvar_delete (cxt->workers [i].condvar);
-            cxt->num_workers = i;
-            break;
-        }
-    }
+    wkr_mutex_obtain (pipeline->mutex);
 
-    if (!cxt->num_workers) {    // if we failed to start any workers, free the array
-        free (cxt->workers);
-        cxt->workers = NULL;
-        wkr_mutex_delete (cxt->mutex);
-        wkr_condvar_delete (cxt->condvar);
-        free (cxt);
-        return NULL;
+    while ((token = next_token (pipeline))) {
+        wkr_mutex_release (pipeline->mutex);
+        run_token (pipeline, token, worker);
+        wkr_mutex_obtain (pipeline->mutex);
     }
 
-    // wait for all worker threads to get to the "Ready" state
+    if (helper)
+        wkr_atomic_add (pipeline->helpers, -1);
 
-    wkr_mutex_obtain (cxt->mutex);
+    wkr_mutex_release (pipeline->mutex);
+}
 
-    while (cxt->workers_ready < cxt->num_workers)
-        wkr_condvar_wait (cxt->condvar, cxt->mutex);
+static void release_pipeline (WorkerPipeline *pipeline)
+{
+    if (!wkr_atomic_add (pipeline->references, -1)) {
+        wkr_mutex_delete (pipeline->mutex);
+        free (pipeline->free_tokens);
+        free (pipeline->tokens);
+        free (pipeline->stages);
+        aligned_free (pipeline);
+    }
+}
 
-    wkr_mutex_release (cxt->mutex);
+static int pipeline_helper (void *param, void *worker)
+{
+    run_tokens (param, worker, 1);
+    release_pipeline (param);
+    return 0;
+}
 
-    return cxt;
+static int pipeline_work (Workers *cxt, void *param)
+{
+    WorkerPipeline *pipeline = param;
+
+    (void) cxt;
+    return wkr_atomic_load (pipeline->work) || wkr_atomic_load (pipeline->finished);
 }
 
-// This is the function that enqueues a job to be completed, potentially by a worker thread
-// or, in some situations, on the calling thread (see "policy" below).
-//
-// The arguments are:
-//
-// cxt:             Context pointer returned by workersInit();
+// Run a pipeline of stages over a stream of items, with the items going through the stages in parallel
+// (like an assembly line) on the worker threads AND the calling thread (which participates fully and
+// only returns once every item has been through every stage). This replaces the pattern of hand-written
+// loops around workersEnqueueJob() for each step of a flow like "read a block, compress it, write it",
+// and because the number of items in the pipeline at once is capped, it keeps every thread busy without
+// ever having more of the items in memory than that. The arguments are:
 //
-// WorkerFunction:  Pointer to the function that will be called to actually do the work. The
-//                  arguments are two void pointers. The first pointer is a pointer to the
-//                  user-defined area that describes the work and possibly provides a place
-//                  to return the results of the work. The second pointer passed in is an
-//                  opaque pointer used by the worker function to call the workerSync()
-//                  function (if desired).
-//
-// WorkerJob:       This is an opaque (to the manager, anyway) pointer that is user-defined
-//                  and descibes the work to be performed. It may contain fields to return
-//                  results or status also if required, and also things like a "stop" flag
-//                  for terminating early. The area pointed to is owned by the caller. It
-//                  obviously may contain pointers to other areas also owned by the caller.
-//                  It might make sense to have the worker function free the pointer on
-//                  completetion, or it might make sense for the caller to free it when the
-//                  results have been extracted from it. In any event, this is the pointer
-//                  that is passed into the worker function as the first argument.
+// cxt:             Context pointer returned by workersInit() (NULL is fine, in which case each item is
+//                  taken through all the stages in turn on the current thread)
 //
-// policy:          This enum controls the execution policy for the individual job, thus:
+// stages:          Array of the stages, each with its stage function and mode. The first stage is the
+//                  input stage, which is always serial, and its function is called (with a NULL item)
+//                  to produce each item, returning NULL when there are no more. The function for each of
+//                  the other stages is called with the item returned by the previous stage (and returns
+//                  the item for the next stage, which can simply be the same one). A stage that returns
+//                  NULL drops the item, and the return value of the last stage is ignored. All the stage
+//                  functions also get the pipelineArg pointer and the same opaque worker pointer that's
+//                  passed to a worker function (so they can use workerAlloc(), but workerSync() should
+//                  NOT be used with it because the items are not associated with job numbers).
 //
-//     WaitForAvailableWorkerThread:    This is the most common case and simply requests that the
-//                                      job be given to the next available worker thread. The
-//                                      function will block if there isn't a worker thread available
-//                                      but will otherwise return immediately. It will not block and
-//                                      execute the job on the user's thread unless there are no
-//                                      worker threads at all (the numWorkers == zero case).
+//                  ParallelStage stages process any number of items at once (in any order) and serial
+//                  stages process one item at a time, either in the order that the input stage produced
+//                  them (SerialInOrderStage, for things like writing the results out in order) or in
+//                  whatever order they arrive (SerialOutOfOrderStage, for things like updating a shared
+//                  structure without a lock).
 //
-//     UseWorkerThreadOnlyIfAvailable:  Similar to the above case, except that if there is no
-//                                      available worker thread the job is executed on the caller's
-//                                      thread (which blocks, obviously). This policy might be useful
-//                                      if there are very few worker threads or for the last job in a
-//                                      batch of jobs where we have to wait until the others have
-//                                      completed anyway (so there's nothing else for the user's
-//                                      thread to do).
+// numStages:       Number of stages in the array (at least one)
 //
-//     DontUseWorkerThread:             Execute the job on the current thread regardless of available
-//                                      worker threads.
+// maxTokens:       Maximum number of items in the pipeline at once (or zero for the default, which is
+//                  four for each participating thread). Too few leaves threads idle when a serial stage
+//                  takes a while, and too many only uses more memory.
 //
-//     FailOnNoWorkerThreadAvailable:   Return failure (0) and do nothing if no worker threads are
-//                                      currently available. This is the only policy that cannot block
-//                                      and the only policy that can fail. It's also the only policy
-//                                      that can result in a job not being started. Note that in the
-//                                      special numWorkers == zero case this policy acts like all the
-//                                      others and simply executes the job on the caller's thread and
-//                                      returns 1.
+// pipelineArg:     User-defined pointer passed to all the stage functions
 //
-// returns:         Zero for failure, otherwise a non-zero job number. In the numWorkers == zero /
-//                  NULL context case, 1 is returned after the task executes to completetion.
+// returns:         The number of items produced by the input stage
 //
-// Note that this is nominally thread-safe and could conceivably be safely called from multiple threads.
-// However, use caution as this breaks some of the functionality. For example, if policies are used
-// that result in jobs being done on the user's thread, having multiple jobs running on the user's
-// thread might happen, and this would break the workerSync() functionality. Also, if this is being
-// called on multiple threads then calling a function like workersNumAvailableWorkers() might end up
-// indicating a worker was available which might be no longer be available before trying to enqueue a
-// job on the same thread.
+// Items that can go on after a stage are run by whichever thread is free first, and helper jobs are only
+// enqueued for worker threads that are available (i.e., this never blocks waiting for a worker), so this
+// works fine when called from inside a worker function, or when the workers are busy with other jobs (in
+// which case the calling thread simply does more of the work itself).
 
-unsigned int workersEnqueueJob (Workers *cxt, int (*workerFunction)(void *, void *), void *workerJob, WorkerPolicy policy)
+int64_t workersPipeline (Workers *cxt, const WorkerStage *stages, int numStages, int maxTokens, void *pipelineArg)
 {
-    uint32_t job_number;
-    int i;
+    WorkerPipeline *pipeline;
+    int64_t num_items = 0;
+    void *worker, *item;
+    int i, j;
 
-    // handle the unitialized numWorkers == zero case by simply executing the job and returning zero
+    if (numStages < 1)
+        return 0;
 
     if (!cxt) {
-        workerFunction (workerJob, cxt);
-        return 1;
-    }
+        size_t used = caller_arena.used;
+        void *overflow = caller_arena.overflow;
 
-    wkr_mutex_obtain (cxt->mutex);
+        while ((item = stages [0].stage_function (NULL, pipelineArg, cxt))) {
+            for (i = 1; i < numStages && item; ++i)
+                item = stages [i].stage_function (item, pipelineArg, cxt);
 
-    // handle the FailOnNoWorkerThreadAvailable policy by returning zero if there are no workers available
+            arena_release (&caller_arena, used, overflow);
+            num_items++;
+        }
 
-    if (!cxt->workers_ready && policy == FailOnNoWorkerThreadAvailable) {
-#ifdef DEBUG
-        failures++;
-#endif
-        wkr_mutex_release (cxt->mutex);
-        return 0;
+        arena_release (&caller_arena, used, overflow);
+        return num_items;
     }
 
-    while (!(job_number = cxt->job_number++));      // get the non-zero job number and increment for the next
+    pipeline = aligned_calloc (1, sizeof (WorkerPipeline));
+    pipeline->workers = cxt;
+    pipeline->arg = pipelineArg;
+    pipeline->num_stages = numStages;
+    pipeline->num_tokens = maxTokens > 0 ? maxTokens : (cxt->num_workers + 1) * 4;
+    pipeline->max_helpers = cxt->num_workers;
+    pipeline->references = 1;
+    wkr_mutex_init (pipeline->mutex);
+
+    // the stages' buffers and the lists of free and ready tokens each have room for all the tokens (and
+    // are allocated together), and all the tokens start out free
+
+    pipeline->stages = calloc (numStages, sizeof (WorkerPipeStage));
+    pipeline->tokens = calloc (pipeline->num_tokens, sizeof (WorkerToken));
+    pipeline->free_tokens = calloc ((size_t) pipeline->num_tokens * (numStages + 2), sizeof (WorkerToken *));
+    pipeline->ready_tokens = pipeline->free_tokens + pipeline->num_tokens;
+
+    for (i = 0; i < numStages; ++i) {
+        pipeline->stages [i].function = stages [i].stage_function;
+        pipeline->stages [i].mode = stages [i].mode;
+        pipeline->stages [i].waiting = pipeline->ready_tokens + (size_t) pipeline->num_tokens * (i + 1);
+    }
 
-    // this handles the case where we might execute the job right here on the user's thread
+    for (j = 0; j < pipeline->num_tokens; ++j)
+        pipeline->free_tokens [pipeline->num_free++] = pipeline->tokens + j;
 
-    if (policy != WaitForAvailableWorkerThread)
-        if (policy == DontUseWorkerThread || (!cxt->workers_ready && policy == UseWorkerThreadOnlyIfAvailable)) {
-#ifdef DEBUG
-            currents++;
-#endif
-            wkr_mutex_release (cxt->mutex);
-            workerFunction (workerJob, cxt);
+    // run tokens (starting with the first item) and when there's nothing for us to do, wait for there
+    // to be (or for the pipeline to be finished) which runs other queued jobs in the meantime
 
-#ifdef DEBUG
-            if (A_BEFORE_B (job_number, last_job))
-                unordered++;
-            else
-                last_job = job_number;
-#endif
-            return job_number;
-        }
+    worker = here_context (cxt);
+    update_pipeline (pipeline);
 
-    // if we get here then we are going to enqueue the job, so first potentially wait until there is an available worker
+    while (1) {
+        run_tokens (pipeline, worker, 0);
 
-    while (!cxt->workers_ready)
-        wkr_condvar_wait (cxt->condvar, cxt->mutex);
+        if (wkr_atomic_load (pipeline->finished))
+            break;
 
-    // there's definitely a worker available, so loop through the individual worker thread looking for one "Ready",
-    // then enqueue the job, set the worker's state to "Running", and signal the worker's thread
+        wait_until (cxt, pipeline, NULL, pipeline_work, pipeline);
+    }
 
-    for (i = 0; i < cxt->num_workers; ++i)
-        if (cxt->workers [i].state == Ready) {
-            cxt->workers [i].job_number = job_number;
-            cxt->workers [i].worker_job = workerJob;
-            cxt->workers [i].worker_function = workerFunction;
-            cxt->workers [i].state = Running;
-            wkr_condvar_signal (cxt->workers [i].condvar);
-            cxt->workers_ready--;
-#ifdef DEBUG
-            enqueues++;
-#endif
-            break;
-        }
+    wkr_mutex_obtain (pipeline->mutex);
+    num_items = pipeline->num_items;
+    wkr_mutex_release (pipeline->mutex);
+    release_pipeline (pipeline);
 
-    wkr_mutex_release (cxt->mutex);
-    return job_number;
+    return num_items;
 }
 
-// Determine whether a specific job number is running, and return TRUE if so. The job number is
-// the non-zero value returned by workersEnqueueJob (). Note that if all the worker functions
-// are calling workerSync(), then a FALSE return from this function would indicate that ALL
-// jobs before the specified one have also completed. Note that this will not apply to a job
-// running on the user's thread (but of course that would indicate that multiple threads
-// were calling into the manager).
+// Reductions let jobs combine their results without contending with each other: instead of every job
+// updating the same shared totals (with workerSync(), or atomics and CAS loops, or a lock) each worker
+// thread combines the values from its jobs into its own accumulator, in its own cache line(s), and the
+// accumulators are only folded together once at the end. The values can be anything (up to the user's
+// combine function), like a count or a sum, or a structure of several totals. The functions are:
+//
+// workersReducerInit():      Set up the reduction (which belongs to the caller) for values of the specified
+//                            size from jobs running on the specified context (which may be NULL). Each of the
+//                            accumulators starts as a copy of the identity value (like zero for a sum) and the
+//                            combine function is called to combine each value into an accumulator (it's given
+//                            the accumulator first, then the value). For a normal reduction numParts is zero,
+//                            and there's an accumulator for each worker thread plus a shared one for any other
+//                            threads (which is locked while it's used). Because the work is divided among the
+//                            threads differently every time, the order in which the values are combined varies,
+//                            which can make a difference (like with floating-point rounding). So if numParts is
+//                            non-zero there's instead an accumulator for each of that many numbered parts of the
+//                            work (like the slices of an array) and they're folded in order, which makes the
+//                            result exactly the same every time. There's still a shared accumulator, folded after
+//                            all the parts, for any values that are combined with workerReduce(). Returns FALSE
+//                            if the memory couldn't be allocated (or the size isn't valid).
+//
+// workerReduce():            Combine a value into the calling thread's accumulator, without any atomic
+//                            operations or locks if it's one of our worker threads. This is called from inside
+//                            a job (or a loop function for workersParallelFor(), or a stage function for
+//                            workersPipeline()) using the second void pointer it was passed, but it can also
+//                            be called from anywhere else with NULL. For a reduction with numbered parts this
+//                            always uses the shared accumulator (which is locked), never one of the parts.
+//
+// workerReducePart():        Combine a value into the accumulator of the specified numbered part (0 to numParts-1)
+//                            of a reduction with numbered parts. Only one thread at a time can use each part
+//                            (which is normally the job for that part of the work). Returns FALSE if the
+//                            reduction has no such part.
+//
+// workersReducerFold():      Combine all the accumulators, in order, into the result (which should have been
+//                            set to the identity value, or to a starting value) and set them back to the identity
+//                            value so the reduction can be used again. This must only be called once all the
+//                            jobs contributing to the reduction are done (like after workersWaitAllJobs()).
+//
+// workersReducerFree():      Free the accumulators.
 
-int workersIsJobRunning (Workers *cxt, uint32_t jobNumber)
+int workersReducerInit (WorkerReducer *reducer, Workers *cxt, const void *identity, int valueSize,
+    void (*combineFunction)(void*,const void*), int numParts)
 {
-    int retval = 0;
+    int i;
 
-    if (cxt) {
-        int i;
+    reducer->workers = cxt;
+    reducer->value_size = valueSize;
+    reducer->combine_function = combineFunction;
+    reducer->ordered = numParts > 0;
+    reducer->shared_lock = 0;
+    reducer->slots = NULL;
 
-        wkr_mutex_obtain (cxt->mutex);
+    if (valueSize < 1)
+        return 0;
 
-        for (i = 0; i < cxt->num_workers; ++i)
-            if (cxt->workers [i].state == Running && cxt->workers [i].job_number == jobNumber) {
-                retval = 1;
-                break;
-            }
+    // the numbered parts are only aligned (like payloads) because there can be very many of them, and each
+    // is normally only used once, but the accumulators for the worker threads each get whole cache lines
 
-        wkr_mutex_release (cxt->mutex);
+    if (reducer->ordered) {
+        reducer->num_slots = numParts + 1;
+        reducer->slot_size = (valueSize + WORKERS_ARENA_ALIGN - 1) & ~(size_t) (WORKERS_ARENA_ALIGN - 1);
+    }
+    else {
+        reducer->num_slots = (cxt ? cxt->num_workers : 0) + 1;
+        reducer->slot_size = (valueSize + WORKERS_CACHE_LINE - 1) & ~(size_t) (WORKERS_CACHE_LINE - 1);
     }
 
-    return retval;
-}
+    if (!(reducer->slots = aligned_malloc (reducer->slot_size * (reducer->num_slots + 1))))
+        return 0;
 
-// Determine whether a specific job number is running, and if so block until it completes. The job
-// number is the non-zero value returned by workersEnqueueJob(). Note that if all the worker
-// functions are calling workerSync(), then this function would block until ALL jobs before the
-// specified one have also completed. Note that this will not apply to a job running on the user's
-// thread (but of course that would indicate that multiple threads were calling into the manager).
+    for (i = 0; i <= reducer->num_slots; ++i)
+        memcpy (reducer->slots + reducer->slot_size * i, identity, valueSize);
 
-void workersWaitOnJob (Workers *cxt, uint32_t jobNumber)
+    return 1;
+}
+
+void workerReduce (WorkerReducer *reducer, void *context, const void *value)
 {
-    if (cxt) {
-        int i;
+    WorkerInfo *worker = context;
 
-        wkr_mutex_obtain (cxt->mutex);
+    char *shared = reducer->ordered ? reducer->slots + reducer->slot_size * (reducer->num_slots - 1) : reducer->slots;
 
-        for (i = 0; i < cxt->num_workers; ++i)
-            while (cxt->workers [i].state == Running && cxt->workers [i].job_number == jobNumber)
-                wkr_condvar_wait (cxt->condvar, cxt->mutex);
+    // our worker threads (and jobs run while they wait) use their own accumulators, and everything
+    // else uses the shared one, which is the first one (or, for reductions with numbered parts, the
+    // one after the parts, which is the only one that's not a part)
 
-        wkr_mutex_release (cxt->mutex);
+    if (!reducer->ordered && worker && worker->worker_number > 0 && worker->workers == reducer->workers) {
+        reducer->combine_function (reducer->slots + reducer->slot_size * worker->worker_number, value);
+        return;
     }
-}
-
-// Block until all jobs have completed, not counting any job(s) running on the user's thread.
-
-void workersWaitAllJobs (Workers *cxt)
-{
-    if (cxt) {
-        wkr_mutex_obtain (cxt->mutex);
 
-        while (cxt->workers_ready < cxt->num_workers)
-            wkr_condvar_wait (cxt->condvar, cxt->mutex);
+    while (!wkr_atomic_cas (reducer->shared_lock, 0, 1))
+        wkr_cpu_relax ();
 
-        wkr_mutex_release (cxt->mutex);
-    }
+    reducer->combine_function (shared, value);
+    wkr_atomic_store (reducer->shared_lock, 0);
 }
 
-// Return the number of jobs currently running on worker threads. This does not include any job(s)
-// running on the user's thread(s).
-
-int workersNumRunningJobs (Workers *cxt)
+int workerReducePart (WorkerReducer *reducer, int part, const void *value)
 {
-    int retval = 0;
-
-    if (cxt) {
-        wkr_mutex_obtain (cxt->mutex);
-        retval = cxt->num_workers - cxt->workers_ready;
-        wkr_mutex_release (cxt->mutex);
-    }
+    if (!reducer->ordered || part < 0 || part >= reducer->num_slots - 1)
+        return 0;
 
-    return retval;
+    reducer->combine_function (reducer->slots + reducer->slot_size * part, value);
+    return 1;
 }
 
-// Return the number of worker threads currently available to accept jobs and do work.
-
-int workersNumAvailableWorkers (Workers *cxt)
+void workersReducerFold (WorkerReducer *reducer, void *result)
 {
-    int retval = 0;
+    const char *identity = reducer->slots + reducer->slot_size * reducer->num_slots;
+    char *slot;
+    int i;
 
-    if (cxt) {
-        wkr_mutex_obtain (cxt->mutex);
-        retval = cxt->workers_ready;
-        wkr_mutex_release (cxt->mutex);
+    for (i = 0; i < reducer->num_slots; ++i) {
+        slot = reducer->slots + reducer->slot_size * i;
+        reducer->combine_function (result, slot);
+        memcpy (slot, identity, reducer->value_size);
     }
-
-    return retval;
 }
 
-// Destroy the specified instance of the workers thread manager. This includes spinning down the
-// worker threads and freeing all resources consumed by the manager. It's probably a good idea
-// to not do this until all the workers are in the "Ready" state (by, for example, calling 
-// workersWaitAllJobs()), but this would normally be the case in well-designed application.
-// After calling this function, the context pointer should not be reused.
-
-void workersDeinit (Workers *cxt)
+void workersReducerFree (WorkerReducer *reducer)
 {
-    if (cxt) {
-        int i;
-
-#ifdef DEBUG
-        printf ("total jobs = %u, failures = %u, enqueues = %u, currents = %u, unordered = %u\n",
-            cxt->job_number - 1, failures, enqueues, currents, unordered);
-#endif
-
-        for (i = 0; i < cxt->num_workers; ++i) {
-            wkr_mutex_obtain (cxt->mutex);
-            cxt->workers [i].state = Quit;
-            wkr_condvar_signal (cxt->workers [i].condvar);
-            wkr_mutex_release (cxt->mutex);
-            wkr_thread_join (cxt->workers [i].thread);
-            wkr_thread_delete (cxt->workers [i].thread);
-            wkr_condvar_delete (cxt->workers [i].condvar);
-        }
-
-        free (cxt->workers);
-        cxt->workers = NULL;
-        wkr_mutex_delete (cxt->mutex);
-        wkr_condvar_delete (cxt->condvar);
-        free (cxt);
-    }
+    aligned_free (reducer->slots);
+    reducer->slots = NULL;
 }
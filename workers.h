@@ -19,10 +19,35 @@
 #define A_BEFORE_B(A,B) (((A)-(B)) & 0x80000000)
 #define A_AFTER_B(A,B) (((B)-(A)) & 0x80000000)
 
+// Fields that are written by one thread and read (or written) by others are aligned to their own
+// cache lines so that threads don't slow each other down by writing unrelated fields that happen to
+// share a cache line ("false sharing"). Defining WORKERS_NO_CACHE_ALIGN turns this off (which is
+// only useful for measuring the difference it makes).
+
+#define WORKERS_CACHE_LINE 64
+
+// This is the largest job payload that can be copied into the job queue (see workersEnqueueJobCopy())
+
+#define WORKERS_PAYLOAD_SIZE 64
+
 // This implements portable multithreading via typedefs and macros for either
 // pthreads or native Windows threads. This is easy since the synchronization
 // constructs we are using (condition variables and mutexes / critical
-// sections) are available on both platforms with similar behavior.
+// sections) are available on both platforms with similar behavior. The atomic
+// operations (used for the lock-free job queue) are similarly mapped to either
+// the Interlocked functions or the GCC (and Clang) builtins. Note that these
+// are all "sequentially consistent" and, except for the ones with the "64"
+// suffix, are only used on 32-bit variables.
+//
+// On Linux we also use futexes directly (unless WORKERS_NO_FUTEX is defined),
+// which lets a thread sleep on (and be woken from) any 32-bit variable without
+// a mutex or condition variable being involved at all. This is used both for
+// parking idle worker threads (each on its own word) and for the other waits
+// (each waiting thread on its own word too).
+//
+// The waits with timeouts (for the functions that take deadlines) are given
+// the time left in nanoseconds, and are all based on the monotonic clock (so
+// the condition variables are created to use that clock with pthreads).
 
 #ifdef _WIN32
 
@@ -41,7 +66,9 @@
 typedef CONDITION_VARIABLE      wkr_condvar_t;
 #define wkr_condvar_init(x)     InitializeConditionVariable(&x)
 #define wkr_condvar_signal(x)   WakeAllConditionVariable(&x)
+#define wkr_condvar_signal_one(x) WakeConditionVariable(&x)
 #define wkr_condvar_wait(x,y)   SleepConditionVariableCS(&x,&y,INFINITE)
+#define wkr_condvar_wait_timeout(x,y,z) SleepConditionVariableCS(&x,&y,(DWORD)(((z)+999999)/1000000))
 #define wkr_condvar_delete(x)
 
 typedef CRITICAL_SECTION        wkr_mutex_t;
@@ -56,16 +83,49 @@ typedef HANDLE                  wkr_thread_t;
 #define wkr_thread_delete(x)    CloseHandle(x);
 #define wkr_thread_exit(x)      _endthreadex(x);
 
+#define wkr_atomic_load(x)      InterlockedOr((volatile LONG*)&(x),0)
+#define wkr_atomic_store(x,y)   InterlockedExchange((volatile LONG*)&(x),(LONG)(y))
+#define wkr_atomic_add(x,y)     InterlockedAdd((volatile LONG*)&(x),(LONG)(y))
+#define wkr_atomic_cas(x,y,z)   (InterlockedCompareExchange((volatile LONG*)&(x),(LONG)(z),(LONG)(y))==(LONG)(y))
+#define wkr_atomic_load64(x)    InterlockedCompareExchange64((volatile LONG64*)&(x),0,0)
+#define wkr_atomic_store64(x,y) InterlockedExchange64((volatile LONG64*)&(x),(LONG64)(y))
+#define wkr_atomic_add64(x,y)   (InterlockedExchangeAdd64((volatile LONG64*)&(x),(LONG64)(y))+(LONG64)(y))
+#define wkr_atomic_cas64(x,y,z) (InterlockedCompareExchange64((volatile LONG64*)&(x),(LONG64)(z),(LONG64)(y))==(LONG64)(y))
+#define wkr_cpu_relax()         YieldProcessor()
+#define wkr_thread_yield()      SwitchToThread()
+
+#ifdef _MSC_VER
+#define wkr_thread_local        __declspec(thread)
+#define wkr_cache_aligned       __declspec(align(WORKERS_CACHE_LINE))
+#else                           /* MinGW */
+#define wkr_thread_local        __thread
+#define wkr_cache_aligned       __attribute__((aligned(WORKERS_CACHE_LINE)))
+#endif
+
 #else
 
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 typedef pthread_cond_t          wkr_condvar_t;
-#define wkr_condvar_init(x)     pthread_cond_init(&x,NULL);
 #define wkr_condvar_signal(x)   pthread_cond_broadcast(&x)
+#define wkr_condvar_signal_one(x) pthread_cond_signal(&x)
 #define wkr_condvar_wait(x,y)   pthread_cond_wait(&x,&y)
 #define wkr_condvar_delete(x)   pthread_cond_destroy(&x)
 
+#ifdef __APPLE__
+#define wkr_condvar_init(x)     pthread_cond_init(&x,NULL);
+#define wkr_condvar_wait_timeout(x,y,z) do { struct timespec wkr_ts = { (time_t)((z)/1000000000), (long)((z)%1000000000) }; \
+    pthread_cond_timedwait_relative_np(&x,&y,&wkr_ts); } while (0)
+#else
+#define wkr_condvar_init(x)     do { pthread_condattr_t wkr_ca; pthread_condattr_init(&wkr_ca); \
+    pthread_condattr_setclock(&wkr_ca,CLOCK_MONOTONIC); pthread_cond_init(&x,&wkr_ca); pthread_condattr_destroy(&wkr_ca); } while (0)
+#define wkr_condvar_wait_timeout(x,y,z) do { struct timespec wkr_ts; clock_gettime(CLOCK_MONOTONIC,&wkr_ts); \
+    wkr_ts.tv_sec += (time_t)((z)/1000000000 + (wkr_ts.tv_nsec+(z)%1000000000)/1000000000); \
+    wkr_ts.tv_nsec = (long)((wkr_ts.tv_nsec+(z)%1000000000)%1000000000); pthread_cond_timedwait(&x,&y,&wkr_ts); } while (0)
+#endif
+
 typedef pthread_mutex_t         wkr_mutex_t;
 #define wkr_mutex_init(x)       pthread_mutex_init(&x,NULL);
 #define wkr_mutex_obtain(x)     pthread_mutex_lock(&x)
@@ -78,6 +138,45 @@ typedef pthread_t               wkr_thread_t;
 #define wkr_thread_delete(x)
 #define wkr_thread_exit(x)      pthread_exit(x);
 
+#define wkr_atomic_load(x)      __atomic_load_n(&(x),__ATOMIC_SEQ_CST)
+#define wkr_atomic_store(x,y)   __atomic_store_n(&(x),y,__ATOMIC_SEQ_CST)
+#define wkr_atomic_add(x,y)     __atomic_add_fetch(&(x),y,__ATOMIC_SEQ_CST)
+#define wkr_atomic_cas(x,y,z)   __sync_bool_compare_and_swap(&(x),y,z)
+#define wkr_atomic_load64(x)    __atomic_load_n(&(x),__ATOMIC_SEQ_CST)
+#define wkr_atomic_store64(x,y) __atomic_store_n(&(x),y,__ATOMIC_SEQ_CST)
+#define wkr_atomic_add64(x,y)   __atomic_add_fetch(&(x),y,__ATOMIC_SEQ_CST)
+#define wkr_atomic_cas64(x,y,z) __sync_bool_compare_and_swap(&(x),y,z)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define wkr_cpu_relax()         __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define wkr_cpu_relax()         __asm__ __volatile__ ("yield")
+#else
+#define wkr_cpu_relax()
+#endif
+
+#define wkr_thread_yield()      sched_yield()
+
+#define wkr_thread_local        __thread
+#define wkr_cache_aligned       __attribute__((aligned(WORKERS_CACHE_LINE)))
+
+#if defined(__linux__) && !defined(WORKERS_NO_FUTEX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define WORKERS_FUTEX
+#define wkr_futex_wait(x,y)     syscall(SYS_futex,&(x),FUTEX_WAIT_PRIVATE,y,NULL,NULL,0)
+#define wkr_futex_wake(x,y)     syscall(SYS_futex,&(x),FUTEX_WAKE_PRIVATE,y,NULL,NULL,0)
+#define wkr_futex_wait_timeout(x,y,z) do { struct timespec wkr_ts = { (time_t)((z)/1000000000), (long)((z)%1000000000) }; \
+    syscall(SYS_futex,&(x),FUTEX_WAIT_PRIVATE,y,&wkr_ts,NULL,0); } while (0)
+#endif
+
+#endif
+
+#ifdef WORKERS_NO_CACHE_ALIGN
+#undef wkr_cache_aligned
+#define wkr_cache_aligned
 #endif
 
 // This enum specifies the policies on using available worker threads
@@ -96,31 +195,332 @@ typedef enum {
 // These are the states that each worker thread goes through
 typedef enum { Uninit, Ready, Running, Done, Quit } WorkerState;
 
+// These are the states that each job goes through, as returned by workersGetJobStatus()
+typedef enum { JobUnknown, JobQueued, JobRunning, JobDone } WorkerJobStatus;
+
+// This enum specifies how jobs are distributed among the worker threads
+typedef enum {
+    SharedQueueScheduling,              // all jobs go through the shared queue and are run in the order enqueued
+
+    WorkStealingScheduling              // jobs enqueued from inside worker functions go into that worker's own
+                                        // deque (and are run most-recent first), and idle workers steal jobs from
+                                        // the deques of other workers (picked at random)
+} WorkerScheduling;
+
+// This enum specifies how the range of workersParallelFor() is divided into chunks
+typedef enum {
+    StaticChunks,                       // equal-sized chunks, by default one for each participating thread
+
+    DynamicChunks,                      // chunks of the specified size (by default a single iteration) that
+                                        // are handed out one at a time as the threads become free
+
+    GuidedChunks                        // chunks that start large (a share of what's left) and shrink as the
+                                        // range gets used up, down to the specified minimum size
+} WorkerChunking;
+
+// This enum specifies how a stage of workersPipeline() handles the items going through it
+typedef enum {
+    ParallelStage,                      // any number of items can be in the stage at once (in any order)
+
+    SerialInOrderStage,                 // one item at a time, in the order the input stage produced them
+
+    SerialOutOfOrderStage               // one item at a time, in whatever order they get to the stage
+} WorkerStageMode;
+
+// This enum specifies how the worker threads are pinned to processors (see workersInitConfig())
+typedef enum {
+    NoAffinity,                         // don't pin the threads, let the OS scheduler move them around freely
+
+    CompactAffinity,                    // pin each thread to its own processor, filling up the hyperthreads of
+                                        // each core (and the cores of each package) before moving on to the next
+
+    ScatterAffinity,                    // pin each thread to its own processor, spreading them across packages
+                                        // and cores, and only doubling up on hyperthreads when there are no cores left
+
+    ListAffinity,                       // pin the threads to the processors in the supplied list, in order
+
+    InheritAffinity                     // give every thread the whole process affinity mask (even if the thread
+                                        // creating them has been restricted to fewer processors)
+} WorkerAffinity;
+
+// This structure is used to specify the configuration of the worker thread manager to workersInitConfig()
+typedef struct {
+    int num_workers;                    // number of worker threads to create (zero is valid, see workersInit())
+    int queue_depth;                    // depth of the queue for jobs waiting for a worker thread (may be zero)
+    WorkerScheduling scheduling;        // how jobs are distributed among the worker threads
+    WorkerAffinity affinity;            // how the worker threads are pinned to processors (if at all)
+    const int *cpu_list;                // processors to use for ListAffinity (reused from the start if too short)
+    int cpu_list_size;                  // number of processors in cpu_list
+    int numa_aware;                     // divide the worker threads among the NUMA nodes, each with its own queue
+} WorkersConfig;
+
 typedef struct Workers Workers;
 
-// Each worker thread owns one of these contexts during its lifetime
+// This is a copy of a job's payload (the union is just to align it for whatever the user puts in it)
+
+typedef union {
+    unsigned char bytes [WORKERS_PAYLOAD_SIZE];
+    uint64_t align_integer;
+    double align_double;
+    void *align_pointer;
+} WorkerPayload;
+
+// This is a slot in the ring of jobs that have been enqueued but not yet picked up by a worker thread
+
+typedef struct {
+    uint32_t sequence;          // ring position that this slot is waiting to be written (or read) at
+    uint32_t job_number;        // the job number that was returned to the caller of workersEnqueueJob()
+    int (*worker_function)(void*,void*); // the user-supplied function to actually perform the work
+    void *worker_job;           // the user-supplied (and -defined) pointer to the work "data"
+    void (*commit_function)(void*); // the user-supplied function to run in job order once the job is done (or NULL)
+    uint32_t payload_size;      // size of the copied payload (if non-zero, it's the work "data" instead)
+    WorkerPayload payload;      // the copied payload (only the first payload_size bytes are valid)
+} WorkerJob;
+
+// This structure specifies a single job for the batch enqueue function, workersEnqueueJobs()
+
+typedef struct {
+    int (*worker_function)(void*,void*); // the user-supplied function to actually perform the work
+    void *worker_job;           // the user-supplied (and -defined) pointer to the work "data"
+} WorkerJobSpec;
+
+// This is the commit function of a job that's done, waiting for its turn (see workersEnqueueJobCommit())
+
+typedef struct {
+    void (*commit_function)(void*); // the user-supplied function to run in job order once the job is done
+    void *worker_job;           // the user-supplied (and -defined) pointer to the work "data" that it's passed
+} WorkerCommit;
+
+// This is a group of jobs that can be waited on (or cancelled) separately from all the other jobs (see
+// workersGroupInit()). It belongs to the caller, who can put it anywhere (like on the stack) as long
+// as it stays around until the group's jobs are done.
+
+typedef struct {
+    Workers *workers;           // the worker thread manager that the group's jobs are enqueued on
+    int num_jobs;               // number of the group's jobs that have been enqueued but have not returned yet
+    int cancelled;              // set by workersGroupCancel() so that the group's jobs that haven't started are dropped
+} WorkerGroup;
+
+// This structure specifies a single stage of a pipeline for workersPipeline()
+
+typedef struct {
+    void *(*stage_function)(void*,void*,void*); // the user-supplied function to process an item in this stage
+    WorkerStageMode mode;       // how the stage handles items (ignored for the first stage, which is always serial)
+} WorkerStage;
+
+// This is a reduction that jobs contribute values to (see workersReducerInit()). It belongs to the caller,
+// who can put it anywhere (like on the stack) as long as it stays around until it's freed.
+
+typedef struct {
+    Workers *workers;           // the worker thread manager whose jobs contribute to the reduction (may be NULL)
+    char *slots;                // the accumulators, followed by a copy of the identity value
+    size_t slot_size;           // distance between the accumulators (whole cache lines, unless they're numbered parts)
+    int num_slots;              // number of accumulators (one for each worker thread or numbered part, plus one shared)
+    int value_size;             // size of the values being reduced
+    int ordered;                // set if the accumulators are numbered parts (folded in order, with the shared one last)
+    int shared_lock;            // taken while a thread other than our worker threads uses the shared accumulator
+    void (*combine_function)(void*,const void*); // the user-supplied function to combine a value into an accumulator
+} WorkerReducer;
+
+// This is the "Chase-Lev" deque owned by each worker for the work-stealing scheduler. The owning worker
+// pushes and pops jobs at the bottom, and other workers steal them from the top (so the two ends are
+// in separate cache lines).
+
+typedef struct {
+    wkr_cache_aligned
+    int32_t top;                // index of the oldest job (the next to be stolen)
+    wkr_cache_aligned
+    int32_t bottom;             // index where the next job will be pushed (only written by the owner)
+    WorkerJob *jobs;            // circular array of jobs (the "sequence" field is not used here)
+    uint32_t mask;              // size of the array minus one (size is a power of 2)
+} WorkerDeque;
+
+// This is a group of worker threads and the ring of jobs waiting for them. With NUMA awareness (see
+// workersInitConfig()) there is one of these for each NUMA node, and otherwise there's just one for
+// all the worker threads. Jobs go into the ring of the node they're meant for, and each worker takes
+// jobs from its own node's ring first and only goes to the other rings when that one is empty.
 
 typedef struct {
+    // set at initialization and then only read
+    int node_id;                // operating system's number for the node (or -1 if there is no NUMA awareness)
+    int *cpus;                  // the processors on the node that the process is allowed to run on
+    int num_cpus;               // number of processors in the list (zero if there is no NUMA awareness)
+    int num_workers;            // number of worker threads on the node
+    WorkerJob *queue;           // lock-free ring of jobs waiting for a worker thread (size is a power of 2)
+    uint32_t queue_mask;        // size of the ring minus one (for converting positions into indices)
+
+    // written by threads enqueuing jobs
+    wkr_cache_aligned
+    uint32_t enqueue_pos;       // ring position where the next job will be written
+
+    // written by worker threads picking up jobs
+    wkr_cache_aligned
+    uint32_t dequeue_pos;       // ring position where the next job will be read (by a worker thread)
+} WorkerNode;
+
+// These are the statistics for each NUMA node returned by workersGetNodeStats(). A "local" job is one
+// that was run by a worker thread of the node it was enqueued for (or that was stolen from the deque of
+// another worker thread on the same node), and a "remote" job is one run by a worker on another node.
+
+typedef struct {
+    int node_id;                // operating system's number for the node (or -1 if there is no NUMA awareness)
+    int num_workers;            // number of worker threads on the node
+    uint64_t local_jobs;        // number of jobs run by the node's worker threads that were meant for the node
+    uint64_t remote_jobs;       // number of jobs run by the node's worker threads that were meant for other nodes
+} WorkersNodeStats;
+
+// Each worker thread has one of these for the scratch memory that workerAlloc() and workerCalloc() hand
+// out to the jobs it runs. The memory is handed out in order from a single block and it's all taken back
+// when the job is done. Whatever doesn't fit in the block is allocated separately (and freed when the job
+// is done), and then the block is made big enough for next time, so that after the first few jobs there
+// is no allocating at all. Jobs run on other threads use one of these too, but without the block.
+
+typedef struct {
+    char *block;                // the block of scratch memory (allocated by the thread that uses it)
+    size_t block_size;          // size of the block
+    size_t used;                // how much of the block has been handed out
+    void *overflow;             // list of the separate allocations (for what didn't fit in the block)
+    size_t overflow_size;       // total size of the separate allocations since the block was last resized
+    int grow;                   // non-zero if the block is made big enough to fit (worker threads only)
+} WorkerArena;
+
+// Threads that have to wait for something spin for a while before sleeping, and how long they spin is
+// based on how long recent waits of the same kind have taken. This is the history of those waits.
+
+typedef struct {
+    uint32_t wait_time;         // running average of how long these waits take (in nanoseconds)
+    uint64_t spins, parks;      // number of waits that ended while spinning, and that had to go to sleep
+} WorkerWaitStats;
+
+// This is the record of a thread that's sleeping until something specific happens, like a certain job
+// completing or all the jobs being done. These live on the waiting threads' stacks and are linked into
+// a list, and a thread causing one of these things to happen wakes only the threads waiting for it (and
+// only takes the mutex to do so if some thread is waiting on something). What is being waited on is
+// identified by an address (of whatever is being waited on) plus a value (the job number, if that's
+// what is being waited on).
+
+typedef struct WorkerWaiter {
+    struct WorkerWaiter *next;  // next waiter in the list (protected by the global mutex)
+    const void *address;        // address of what is being waited on
+    uint32_t value;             // specific value being waited on (job number, or zero)
+    uint32_t woken;             // set (by the waking thread) when the waiter has been removed from the list
+    uint64_t wake_time;         // time that the waiter was woken in nanoseconds
+#ifndef WORKERS_FUTEX
+    wkr_condvar_t condvar;      // this is where the waiter actually sleeps (protected by global mutex)
+#endif
+} WorkerWaiter;
+
+// This is a job that has been enqueued with prerequisites (see workersEnqueueJobAfter()) that are not
+// done yet. It has its job number and its place (in the queue or with a worker thread) already, but it's
+// held in a list (rather than the queue) so that it doesn't tie up a worker thread while it waits. Like
+// a waiter it's identified by the job number it's waiting on, which is one prerequisite at a time.
+
+typedef struct WorkerHeldJob {
+    struct WorkerHeldJob *next; // next held job in the list (protected by the global mutex)
+    WorkerNode *node;           // node whose ring the job goes into once it's released
+    WorkerJob job;              // the job itself (including its job number and payload, if any)
+    uint32_t waiting_on;        // the job number of the prerequisite currently being waited on
+    int next_prerequisite;      // index of the next prerequisite to check (after that one)
+    int num_prerequisites;      // number of prerequisites (which are stored right after the structure)
+} WorkerHeldJob;
+
+// These are the statistics returned by workersGetStats(), which show how well the spin-then-park waiting
+// is working. The "worker" entries are for idle worker threads waiting for jobs and the "waiter" entries
+// are for all the other waits (workerSync(), workersWaitOnJob(), workersWaitAllJobs() and waiting for
+// room in the queue). The average wait times are what the spin budgets are based on.
+
+typedef struct {
+    uint64_t worker_spins, worker_parks, waiter_spins, waiter_parks;
+    uint32_t worker_wait_time, waiter_wait_time;
+} WorkersStats;
+
+// Each worker thread owns one of these contexts during its lifetime. The fields are grouped by which
+// threads write them, and each group that's written while the workers are running gets its own cache
+// line(s), so the array of these (and the worker threads using them) don't interfere with each other.
+
+typedef struct {
+    // set at initialization and then only read
     int worker_number;          // starting with 1 (0 is reserved for global structure)
     Workers *workers;           // pointer back to global structure
-    WorkerState state;          // current state of the worker thread
-    wkr_condvar_t condvar;      // these individual condvars are signaled by the background thread when the worker
-                                // thread's "state" has been updated from "Ready" (either to "Running" or to "Quit")
     wkr_thread_t thread;        // this is the actual thread for the worker
+    int cpu;                    // processor the thread is pinned to (or -1 if it's not pinned to a single one)
+    WorkerNode *node;           // the node that the worker belongs to (and takes jobs from first)
+
+    // written by the worker thread for each job it runs (and read by other threads)
+    wkr_cache_aligned
+    WorkerState state;          // current state of the worker thread (only written by the worker thread)
     uint32_t job_number;        // this is the 32-bit incrementing non-zero job number (used for synchronization)
     int (*worker_function)(void*,void*); // this is the user-supplied function to actually perform the work
     void *worker_job;           // this is the user-supplied (and -defined) pointer to the work "data"
+    void (*commit_function)(void*); // this is the user-supplied function to run in job order afterward (or NULL)
+    uint32_t random;            // random number state for picking which other workers to steal from
+    uint64_t local_jobs;        // number of jobs run that were meant for this worker's node
+    uint64_t remote_jobs;       // number of jobs run that were meant for other nodes
+    WorkerArena arena;          // scratch memory for the jobs (only used by the worker thread)
+    WorkerPayload payload;      // copy of the current job's payload (if it has one)
+
+    // the deque has its own cache lines for the two ends (see above)
+    WorkerDeque deque;          // jobs enqueued from inside this worker's jobs (work-stealing scheduling only)
+
+    // written by the threads that wake up the worker thread
+    wkr_cache_aligned
+    uint32_t parked;            // non-zero while the worker is idle and sleeping (or about to), cleared to wake it
+    uint64_t wake_time;         // time that the worker was last woken from being parked (in nanoseconds)
+#ifndef WORKERS_FUTEX
+    wkr_condvar_t condvar;      // this is where the worker sleeps while parked (protected by global mutex)
+#endif
 } WorkerInfo;
 
+// This is the global structure for the worker thread manager. Like WorkerInfo above, the fields are
+// grouped by which threads write them (and how often), with each group in its own cache line(s).
+
 struct Workers {
+    // set at initialization (or, for "quit", at the very end) and otherwise only read
     int worker_number;          // always 0 (to distinguish the structure from individual worker thread pointers)
     WorkerInfo *workers;        // pointer to the worker threads
     int num_workers;            // total number of worker threads
-    int workers_ready;          // number of workers current in "Ready" state
+    WorkerNode *nodes;          // the nodes that the worker threads are divided among (each with its own ring)
+    int num_nodes;              // number of nodes (one if there is no NUMA awareness)
+    int *cpu_nodes;             // index of the node for each processor number (or -1), for finding the caller's node
+    int num_cpu_nodes;          // number of entries in cpu_nodes
+    int queue_depth;            // maximum number of jobs that can wait in the queue (may be zero)
+    WorkerScheduling scheduling;// how jobs are distributed among the worker threads
+    WorkerAffinity affinity;    // how the worker threads are pinned to processors
+    uint64_t *job_table;        // status of every job from the commit ticket on, indexed by job number
+    uint32_t *skip_table;       // number of the last job number skipped over, indexed by job number
+    uint64_t *job_results;      // value returned by each job (for as long as possible), indexed by job number
+    uint32_t *cancel_table;     // number of the last job cancelled, indexed by job number
+    WorkerCommit *commit_table; // commit functions of jobs that are waiting for their turn, indexed by job number
+    uint32_t max_spin;          // longest any thread will spin before sleeping (zero on single processors)
+    int quit;                   // set by workersDeinit() to tell the worker threads to exit
+
+    // written by threads enqueuing jobs
+    wkr_cache_aligned
     unsigned int job_number;    // next job number to be requested
-    wkr_condvar_t condvar;      // this condvar is signaled by worker threads when they become "ready" which,
-                                // except at initialization, also indicates that they just finished a job
-    wkr_mutex_t mutex;          // global mutex protecting workers_ready count and worker's current states
+
+    // written by both for every job
+    wkr_cache_aligned
+    int jobs_pending;           // number of jobs either waiting in the queue (or deques) or running on worker threads
+    int workers_ready;          // number of workers current in "Ready" state
+
+    // written by worker threads completing jobs
+    wkr_cache_aligned
+    uint32_t commit_ticket;     // oldest job number that's not done yet (workerSync() waits for its turn here)
+    int commits_pending;        // number of jobs that are waiting for their turn to run their commit functions
+
+    // written by threads going to sleep (or waking them up)
+    wkr_cache_aligned
+    int workers_parked;         // number of idle workers that are parked (or about to be) waiting for jobs
+    int num_waiters;            // number of waiters in the list (so the list is only locked if there are some)
+    WorkerWaiter *waiters;      // list of threads sleeping until something specific happens (like a job completing)
+    int num_held_jobs;          // number of jobs in the held list (so the list is only locked if there are some)
+    WorkerHeldJob *held_jobs;   // list of jobs that are waiting for their prerequisites to be done
+    wkr_mutex_t mutex;          // global mutex, only taken by threads going to sleep (or waking them up) and for held jobs
+
+    // written at the end of waits
+    wkr_cache_aligned
+    WorkerWaitStats idle_stats; // how waits by idle workers for jobs have been going
+    WorkerWaitStats wait_stats; // how all the waits other than by idle workers have been going
 };
 
 #ifdef __cplusplus
@@ -128,14 +528,63 @@ extern "C" {
 #endif
 
 Workers *workersInit (int numWorkerThreads);
+Workers *workersInitQueue (int numWorkerThreads, int queueDepth);
+Workers *workersInitConfig (const WorkersConfig *config);
 uint32_t workersEnqueueJob (Workers *cxt, int (*workerFunction)(void*,void*), void *WorkerJob, WorkerPolicy policy);
+uint32_t workersEnqueueJobs (Workers *cxt, const WorkerJobSpec *jobs, int numJobs, WorkerPolicy policy);
+uint32_t workersEnqueueJobCopy (Workers *cxt, int (*workerFunction)(void*,void*), const void *payload, int payloadSize, WorkerPolicy policy);
+uint32_t workersEnqueueJobsCopy (Workers *cxt, int (*workerFunction)(void*,void*), const void *payloads, int payloadSize,
+    int numJobs, WorkerPolicy policy);
+uint32_t workersEnqueueJobOnNode (Workers *cxt, int node, int (*workerFunction)(void*,void*), void *WorkerJob, WorkerPolicy policy);
+uint32_t workersEnqueueJobsOnNode (Workers *cxt, int node, const WorkerJobSpec *jobs, int numJobs, WorkerPolicy policy);
+uint32_t workersEnqueueJobAfter (Workers *cxt, int (*workerFunction)(void*,void*), void *WorkerJob,
+    const uint32_t *prerequisites, int numPrerequisites, WorkerPolicy policy);
+uint32_t workersEnqueueJobCopyAfter (Workers *cxt, int (*workerFunction)(void*,void*), const void *payload, int payloadSize,
+    const uint32_t *prerequisites, int numPrerequisites, WorkerPolicy policy);
+uint32_t workersEnqueueJobUntil (Workers *cxt, int (*workerFunction)(void*,void*), void *WorkerJob, uint64_t deadline);
+uint32_t workersEnqueueJobCommit (Workers *cxt, int (*workerFunction)(void*,void*), void (*commitFunction)(void*),
+    void *WorkerJob, WorkerPolicy policy);
+uint32_t workersEnqueueJobsCommit (Workers *cxt, const WorkerJobSpec *jobs, int numJobs, void (*commitFunction)(void*),
+    WorkerPolicy policy);
 void workersWaitOnJob (Workers *cxt, uint32_t jobNumber);
+int workersWaitOnJobUntil (Workers *cxt, uint32_t jobNumber, uint64_t deadline);
 int workersIsJobRunning (Workers *cxt, uint32_t jobNumber);
+WorkerJobStatus workersGetJobStatus (Workers *cxt, uint32_t jobNumber);
+int workersGetJobResult (Workers *cxt, uint32_t jobNumber, int *result);
+int workersTryGetJobResult (Workers *cxt, uint32_t jobNumber, int *result);
+int workersCancelJob (Workers *cxt, uint32_t jobNumber);
+int workersCancelJobs (Workers *cxt, uint32_t firstJob, int numJobs);
+int workersCancelAllJobs (Workers *cxt);
 int workersNumAvailableWorkers (Workers *cxt);
+void workersGetStats (Workers *cxt, WorkersStats *stats);
+int workersGetPlacement (Workers *cxt, int *cpus, int maxCpus);
+int workersGetNodeStats (Workers *cxt, WorkersNodeStats *stats, int maxNodes);
 int workersNumRunningJobs (Workers *cxt);
+int workersNumQueuedJobs (Workers *cxt);
 void workersWaitAllJobs (Workers *cxt);
+int workersWaitAllJobsUntil (Workers *cxt, uint64_t deadline);
+uint64_t workersGetTime (void);
 void workersDeinit (Workers *cxt);
 void workerSync (void *context);
+int workerNumber (void *context);
+int workerCancelled (void *context);
+void *workerAlloc (void *context, size_t size);
+void *workerCalloc (void *context, size_t num, size_t size);
+int workersParallelFor (Workers *cxt, int64_t begin, int64_t end, int (*loopFunction)(void*,int64_t,int64_t,void*),
+    void *loopArg, WorkerChunking chunking, int64_t chunkSize);
+void workersGroupInit (WorkerGroup *group, Workers *cxt);
+uint32_t workersGroupEnqueueJob (WorkerGroup *group, int (*workerFunction)(void*,void*), void *WorkerJob, WorkerPolicy policy);
+int workersGroupNumJobs (WorkerGroup *group);
+void workersGroupWait (WorkerGroup *group);
+int workersGroupWaitUntil (WorkerGroup *group, uint64_t deadline);
+int workersGroupCancel (WorkerGroup *group);
+int64_t workersPipeline (Workers *cxt, const WorkerStage *stages, int numStages, int maxTokens, void *pipelineArg);
+int workersReducerInit (WorkerReducer *reducer, Workers *cxt, const void *identity, int valueSize,
+    void (*combineFunction)(void*,const void*), int numParts);
+void workerReduce (WorkerReducer *reducer, void *context, const void *value);
+int workerReducePart (WorkerReducer *reducer, int part, const void *value);
+void workersReducerFold (WorkerReducer *reducer, void *result);
+void workersReducerFree (WorkerReducer *reducer);
 
 #ifdef __cplusplus
 }